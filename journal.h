@@ -0,0 +1,157 @@
+/*
+ * journal.h - libjournal: VSFS metadata journaling as a library
+ *
+ * The journal tool (journalv1.c) is a thin command-line wrapper around this API; a
+ * service can link libjournal.c directly and skip a fork/exec per operation.
+ *
+ * Conventions:
+ * - Functions return 0 (or a count where noted) on success and a negative errno value
+ *   on failure; journal_errmsg() then describes what failed. Running out of memory
+ *   aborts the process.
+ * - One image is open per process at a time (the geometry and options are process
+ *   wide); journal_open and journal_mkfs return -EBUSY while another is open.
+ * - Block transactions (journal_txn_*) may be committed from several threads at once;
+ *   each journal_txn belongs to one thread. Everything else uses the handle from one
+ *   thread at a time, with no commits in flight. journal_errmsg is per thread.
+ * - The library starts threads (install workers, the background checkpointer),
+ *   synchronizes concurrent commits and picks its CRC32C and bitmap search
+ *   kernels with pthread_once, so it needs -pthread to compile and link:
+ *       gcc -O2 -pthread -o journal journalv1.c libjournal.c
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* journal_mkfs defaults, used for zero fields of struct journal_mkfs_params */
+#define JOURNAL_MKFS_BLOCK_SIZE        4096
+#define JOURNAL_MKFS_JOURNAL_BLOCKS    16
+#define JOURNAL_MKFS_INODE_TBL_BLOCKS  2
+#define JOURNAL_MKFS_DATA_BLOCKS       64
+#define JOURNAL_MIN_JOURNAL_BLOCKS     8      /* header + DESC + one create's images + COMMIT */
+
+enum journal_sync {
+    JOURNAL_SYNC_NONE,     /* no flushes */
+    JOURNAL_SYNC_COMMIT,   /* one fdatasync per transaction, one before install empties the log */
+    JOURNAL_SYNC_FULL,     /* as commit, plus header updates: durable on return */
+};
+
+enum journal_format {
+    JOURNAL_FORMAT_RECORD, /* byte-packed DATA/ZDATA/DELTA records */
+    JOURNAL_FORMAT_BLOCK,  /* block-aligned descriptor/image/commit blocks (O_DIRECT capable) */
+};
+
+struct journal_options {
+    unsigned checkpoint_pct;   /* checkpoint before the journal passes this % full; 0 = 100 */
+    enum journal_sync sync;
+    int direct;                /* journal writes with O_DIRECT (block format only) */
+    int full_images;           /* log whole blocks as DATA records: no DELTA/ZDATA */
+    int exclusive;             /* hold the journal lock until journal_close; the header is
+                                  then cached, other processes wait (daemon mode), and
+                                  concurrent commits write their records in parallel */
+    unsigned install_threads;  /* write-back threads for install and checkpoints; 0 = one
+                                  per CPU. Small installs always use the calling thread. */
+    int io_uring;              /* submit transaction and install writes through io_uring
+                                  in batches; pread/pwrite where it is not available */
+    int mmap_image;            /* map the image once: memcpy instead of read/write, msync
+                                  of the written range as barrier. Not with direct;
+                                  takes precedence over io_uring. */
+    int background_checkpoint; /* checkpoint from a background thread once the journal
+                                  passes checkpoint_pct; appends only wait for a
+                                  checkpoint when the journal is full */
+    unsigned checkpoint_low_pct;   /* background: install the oldest transactions until
+                                      the journal is at most this % full (below
+                                      checkpoint_pct); 0 = all of them */
+};
+
+/* In: requested layout, 0 = default. Out: the layout actually written. */
+struct journal_mkfs_params {
+    uint32_t block_size;
+    uint32_t journal_blocks;
+    uint32_t inodes;           /* rounded up to fill the inode table blocks */
+    uint32_t total_blocks;     /* 0: just enough for JOURNAL_MKFS_DATA_BLOCKS data blocks */
+    enum journal_format format;
+    uint32_t data_blocks;      /* out only */
+};
+
+struct journal_install_stats {
+    uint32_t ntxn;             /* committed transactions replayed */
+    uint32_t nrec;             /* DATA/ZDATA/DELTA records among them */
+    uint32_t nwrites;          /* home block writes after dedup */
+};
+
+/* Geometry of the open image */
+struct journal_layout {
+    uint32_t block_size;
+    uint32_t total_blocks;
+    uint32_t journal_blocks;
+    uint32_t first_logged;     /* lowest block a transaction may log (the inode bitmap) */
+    uint32_t data_start;
+};
+
+/* Counters since journal_open */
+struct journal_stats {
+    unsigned created;          /* journal_create successes */
+    unsigned failed;           /* journal_create failures */
+    unsigned groups;           /* group-commit transactions written */
+    unsigned records;          /* records in them */
+    unsigned checkpoints;      /* automatic checkpoints by appenders */
+    unsigned bg_checkpoints;   /* checkpoints by the background checkpointer */
+    unsigned meta_hits;        /* metadata block reads served from the cache */
+    unsigned meta_misses;      /* metadata blocks read from the journal or home */
+};
+
+struct journal;
+struct journal_txn;
+
+/* Build an empty image at path (root directory and an empty journal). */
+int journal_mkfs(const char *path, struct journal_mkfs_params *p);
+
+/* Open an image made by journal_mkfs; opt may be NULL for the defaults. An empty
+ * journal of an older on-disk version is upgraded, and a torn tail left by a crashed
+ * append is cut back to the last committed transaction. */
+int journal_open(const char *path, const struct journal_options *opt, struct journal **jp);
+
+/* Commit pending creates (journal_flush) and release the handle, even on error. */
+int journal_close(struct journal *j);
+
+/* ---- block transactions ----
+ * Log full images of home blocks and commit them atomically. Images are referenced,
+ * not copied: they must stay valid until journal_txn_commit. Do not log metadata
+ * blocks that journal_create is changing in the same process. Commits from several
+ * threads are ordered by sequence number; on an exclusive handle each one claims its
+ * log space without a lock and only the header update is serialized. */
+int journal_txn_begin(struct journal *j, struct journal_txn **tp);
+int journal_txn_log_block(struct journal_txn *t, uint32_t block_no, const void *image);
+/* Checkpoints first if the journal has no room; frees t, also on error. */
+int journal_txn_commit(struct journal_txn *t);
+void journal_txn_abort(struct journal_txn *t);
+
+/* ---- VSFS creates ----
+ * journal_create adds a file to the root directory in memory and returns its inode;
+ * creates are grouped into as few transactions as fit and reach the journal when the
+ * group is full or on journal_flush / journal_install / journal_close. A name is 1 to
+ * JOURNAL_NAME_MAX bytes without '/'; a longer one fails with -ENAMETOOLONG. */
+#define JOURNAL_NAME_MAX 27        /* a dirent's name field, minus its terminating NUL */
+int journal_create(struct journal *j, const char *name, uint32_t *ino);
+/* Commit the open group. Returns 1 if a transaction was written, 0 if none was pending. */
+int journal_flush(struct journal *j);
+
+/* Flush, then replay committed transactions to their home blocks and empty the log.
+ * Returns 1, or 0 if the journal was empty; st may be NULL. */
+int journal_install(struct journal *j, struct journal_install_stats *st);
+
+void journal_get_layout(const struct journal *j, struct journal_layout *l);
+void journal_get_stats(const struct journal *j, struct journal_stats *st);
+
+/* Description of the last failure in this thread */
+const char *journal_errmsg(void);
+
+/* CRC32C kernels, for benchmarking: "auto" (what the journal uses), "table" or
+ * "sse4.2". NULL if the kernel is not available on this CPU. */
+typedef uint32_t (*journal_crc_fn)(uint32_t crc, const void *buf, size_t len);
+journal_crc_fn journal_crc32c_kernel(const char *name);
+
+#endif /* JOURNAL_H */
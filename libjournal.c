@@ -0,0 +1,3562 @@
+/*
+ * libjournal.c - VSFS metadata journaling library (see journal.h)
+ *
+ * Everything the journal tool does to an image lives here: mkfs, the journal log
+ * (record and block formats), transactions, VSFS creates with group commit, automatic
+ * checkpoints and install. journalv1.c is the command-line front end.
+ *
+ * Errors are returned as negative errno values up the call chain; jfail() records the
+ * message journal_errmsg() reports. Only allocation failures abort (oom).
+ */
+
+#define _GNU_SOURCE        /* O_DIRECT, copy_file_range */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE          /* from linux/fs.h; VSFS has its own */
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>     /* SSE4.2 crc32 */
+#include <wmmintrin.h>     /* PCLMUL */
+#include <immintrin.h>     /* SSE2/AVX2 bitmap search */
+#endif
+
+#include "journal.h"
+
+/* =========================
+ *        DISK LAYOUT
+ * =========================
+ * Block size: 4 KB
+ *
+ * Block 0:  Superblock (1 block)
+ * Blocks 1-16: Journal (16 blocks)
+ * Block 17: Inode Bitmap (1 block)
+ * Block 18: Data Bitmap  (1 block)
+ * Blocks 19-20: Inode Table (2 blocks)
+ * Blocks 21-84: Data Blocks (64 blocks)
+ *
+ * That is the image mkfs builds by default. The layout actually used is read from the
+ * superblock at startup (geometry_load) into geo; regions keep this order but may be
+ * any size, bitmaps and inode table may span several blocks.
+ */
+
+#define SUPERBLOCK_BLK       0
+#define JOURNAL_START_BLK    1
+
+/* mkfs defaults */
+#define BLOCK_SIZE           JOURNAL_MKFS_BLOCK_SIZE
+#define JOURNAL_NBLOCKS      JOURNAL_MKFS_JOURNAL_BLOCKS
+#define INODE_TBL_NBLOCKS    JOURNAL_MKFS_INODE_TBL_BLOCKS
+#define DATA_NBLOCKS         JOURNAL_MKFS_DATA_BLOCKS
+
+#define MIN_BLOCK_SIZE       512
+#define MAX_BLOCK_SIZE       32768   /* a DATA record's size must fit rec_header.size */
+
+/* =========================
+ *        JOURNAL SPEC
+ * ========================= */
+
+#define JOURNAL_MAGIC   0x4A524E4C   /* "JRNL" */
+#define JOURNAL_VERSION_RECORD  7    /* circular log of byte-packed DATA/DELTA/ZDATA records,
+                                        CRC32C in COMMIT (4 = no DELTA, 6 = no ZDATA) */
+#define JOURNAL_VERSION_BLOCK   5    /* circular log of block-aligned descriptor/image/commit blocks,
+                                        CRC32C in COMMIT (1 = original linear format, 2/3 = no CRC) */
+#define JOURNAL_VERSION JOURNAL_VERSION_RECORD   /* what a new journal gets unless mkfs -F block */
+#define REC_DATA        1
+#define REC_COMMIT      2
+#define REC_PAD         3            /* rest of the region is unused, continue at the log start */
+#define REC_DESC        4            /* block format: descriptor block */
+#define REC_DELTA       5            /* record format: byte range of a block */
+#define REC_ZDATA       6            /* record format: compressed block image */
+
+/* Circular log: live records are [head, tail), wrapping from the end of the region back
+ * to the log start (journal_log_start). A transaction is never split across the wrap
+ * point; if it does not fit before the end, a PAD record is written at tail and the
+ * transaction starts at the log start. install checkpoints [head, tail) and only moves
+ * head forward, so creates can keep appending behind it. */
+struct journal_header {
+    uint32_t magic;        /* store JOURNAL_MAGIC */
+    uint32_t nbytes_used;  /* log start + live log bytes (PAD included) */
+    uint32_t version;      /* JOURNAL_VERSION_RECORD or JOURNAL_VERSION_BLOCK */
+    uint32_t head;         /* offset of the oldest live record */
+    uint32_t tail;         /* offset where the next record is appended */
+    uint32_t head_seq;     /* sequence number of the transaction at head */
+    uint32_t next_seq;     /* sequence number of the next transaction appended */
+    uint32_t _reserved;
+};
+
+struct rec_header {
+    uint16_t type;         /* REC_DATA, REC_DELTA, REC_ZDATA, REC_COMMIT or REC_PAD */
+    uint16_t size;         /* total record size in bytes (including this header) */
+};
+
+/* DATA record:
+ * struct data_record {
+ *   struct rec_header hdr;   // type = REC_DATA
+ *   uint32_t block_no;       // absolute home block index in disk image
+ *   uint8_t data[block_size];  // full block image
+ * };
+ *
+ * Total size = sizeof(rec_header) + sizeof(uint32_t) + block size
+ */
+#define DATA_REC_SIZE (sizeof(struct rec_header) + sizeof(uint32_t) + geo.block_size)
+
+/* DELTA record: replaces bytes [offset, offset + length) of block block_no with the
+ * length bytes that follow. Install applies a block's DATA and DELTA records in log
+ * order, starting from its home image (or the latest DATA image, if any).
+ */
+struct delta_rec_prefix {
+    struct rec_header hdr;   /* type = REC_DELTA, size = sizeof(prefix) + length */
+    uint32_t block_no;
+    uint16_t offset;
+    uint16_t length;
+};
+#define DELTA_REC_SIZE(len) (sizeof(struct delta_rec_prefix) + (len))
+
+/* ZDATA record: a DATA record whose image is stored compressed; codec says how (only
+ * ZCODEC_RLE so far, see BLOCK COMPRESSION). Written only when it is smaller than
+ * the DATA record. Install decompresses it and treats it like a DATA image.
+ */
+struct zdata_rec_prefix {
+    struct rec_header hdr;   /* type = REC_ZDATA, size = sizeof(prefix) + zlen */
+    uint32_t block_no;
+    uint16_t codec;
+    uint16_t zlen;           /* compressed image bytes that follow */
+};
+#define ZCODEC_RLE 1
+#define ZDATA_REC_SIZE(zlen) (sizeof(struct zdata_rec_prefix) + (zlen))
+
+/* COMMIT record: seals one transaction.
+ * Carries the transaction's sequence number so install can check that the log
+ * between head and tail is one unbroken run of transactions, and a CRC32C of the
+ * transaction (see txn_csum) so a torn transaction is detected by install instead of
+ * being prevented by a flush between the records and the COMMIT.
+ */
+struct commit_record {
+    struct rec_header hdr;   /* type = REC_COMMIT */
+    uint32_t seq;
+    uint32_t csum;
+};
+#define COMMIT_REC_SIZE (sizeof(struct commit_record))
+
+/* Block-aligned format (JOURNAL_VERSION_BLOCK):
+ * journal_header owns all of journal block 0, the log starts at block 1 and every
+ * record is whole blocks:
+ *   DESC block: jblock_header{REC_DESC, seq, count} + uint32_t block_no[count]
+ *   count image blocks, in descriptor order, each at a block-aligned journal offset
+ *   COMMIT block: jblock_header{REC_COMMIT, seq, csum}
+ * A PAD block sends the scan back to the log start. Because images are aligned the
+ * journal can be written with O_DIRECT and install can hand images to the kernel
+ * (copy_file_range) without a user-space copy.
+ */
+struct jblock_header {
+    uint32_t magic;        /* JOURNAL_MAGIC */
+    uint16_t type;         /* REC_DESC, REC_COMMIT or REC_PAD */
+    uint16_t _pad;
+    uint32_t seq;
+    uint32_t count;        /* DESC: number of block_no entries that follow */
+    uint32_t csum;         /* COMMIT: txn_csum over the DESC block and the images */
+};
+#define DESC_MAX_BLOCKS ((geo.block_size - sizeof(struct jblock_header)) / sizeof(uint32_t))
+
+/* =========================
+ *     VSFS STRUCTS (mkfs)
+ * =========================
+ * Same on-disk layout as the project's mkfs/validator:
+ * inode 0 is the root directory, its direct[0] points at the root directory block,
+ * a dirent slot is free when name[0] == '\0'.
+ */
+
+#define FS_MAGIC         0x56534653   /* "VSFS" */
+#define INODE_SIZE       128
+#define DIRECT_POINTERS  8
+#define NAME_LEN         (JOURNAL_NAME_MAX + 1)   /* 28 */
+#define ROOT_INO         0
+
+#define INODE_TYPE_FREE  0
+#define INODE_TYPE_FILE  1
+#define INODE_TYPE_DIR   2
+
+struct superblock {
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t total_blocks;
+    uint32_t inode_count;
+    uint32_t journal_block;
+    uint32_t inode_bitmap;
+    uint32_t data_bitmap;
+    uint32_t inode_start;
+    uint32_t data_start;
+    uint8_t  _pad[128 - 9 * 4];
+};
+
+struct inode {
+    uint16_t type;         /* INODE_TYPE_* */
+    uint16_t links;
+    uint32_t size;         /* bytes */
+    uint32_t direct[DIRECT_POINTERS];
+    uint32_t ctime;
+    uint32_t mtime;
+    uint8_t  _pad[INODE_SIZE - (2 + 2 + 4 + DIRECT_POINTERS * 4 + 4 + 4)];
+};
+
+struct dirent {
+    uint32_t inode;
+    char     name[NAME_LEN];
+};
+
+/* =========================
+ *        GEOMETRY
+ * =========================
+ * Runtime copy of the layout described by the superblock.
+ */
+
+struct geometry {
+    uint32_t block_size;
+    uint32_t total_blocks;
+    uint32_t inode_count;
+    uint32_t journal_start;         /* first journal block (holds journal_header) */
+    uint32_t journal_nblocks;
+    uint32_t journal_bytes;         /* journal_nblocks * block_size */
+    uint32_t inode_bmap;            /* first inode bitmap block */
+    uint32_t data_bmap;             /* first data bitmap block */
+    uint32_t inode_tbl;             /* first inode table block */
+    uint32_t inode_tbl_nblocks;
+    uint32_t data_start;            /* first data block */
+    uint32_t data_nblocks;
+    uint32_t inodes_per_block;
+    uint32_t dirents_per_block;
+};
+
+static struct geometry geo;
+
+/* =========================
+ *        BASIC HELPERS
+ * ========================= */
+
+static __thread char jerr_msg[256];
+
+const char *journal_errmsg(void) {
+    return jerr_msg;
+}
+
+/* Record a failure for journal_errmsg and return -err */
+__attribute__((format(printf, 2, 3)))
+static int jfail(int err, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(jerr_msg, sizeof(jerr_msg), fmt, ap);
+    va_end(ap);
+    return -err;
+}
+
+/* A read/write of the wrong size: errno if it failed, EIO if it was short */
+static int jfail_io(const char *what, ssize_t n) {
+    int err = n < 0 ? errno : EIO;
+    return jfail(err, "%s: %s", what, n < 0 ? strerror(err) : "short transfer");
+}
+
+static void oom(void) {
+    fputs("libjournal: out of memory\n", stderr);
+    abort();
+}
+
+static void *xmalloc(size_t n) {
+    void *p = malloc(n);
+    if (!p) oom();
+    return p;
+}
+
+/* =========================
+ *        CRC32C
+ * =========================
+ * Castagnoli CRC (reflected polynomial 0x82F63B78), zlib-style API:
+ * crc32c(0, buf, len) starts a checksum, passing the result back in continues it.
+ *
+ * crc32c() dispatches once, on first use, to the fastest kernel the CPU has:
+ * - crc32c_hw: SSE4.2 crc32 instruction, 8 bytes at a time. Runs of 3*lane bytes are
+ *   split into three independent streams to hide the instruction's 3-cycle latency,
+ *   and the streams are folded together with one PCLMUL multiply each.
+ * - crc32c_sw: portable slicing-by-8 tables.
+ * `journal bench-crc` compares them.
+ */
+
+#define CRC32C_POLY 0x82F63B78u
+
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_table_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (CRC32C_POLY & (0u - (c & 1)));
+        crc32c_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xff];
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    crc = ~crc;
+    while (len && ((uintptr_t)p & 7)) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);                      /* little-endian hosts only, like the on-disk format */
+        w ^= crc;
+        crc = crc32c_table[7][w & 0xff] ^ crc32c_table[6][(w >> 8) & 0xff] ^
+              crc32c_table[5][(w >> 16) & 0xff] ^ crc32c_table[4][(w >> 24) & 0xff] ^
+              crc32c_table[3][(w >> 32) & 0xff] ^ crc32c_table[2][(w >> 40) & 0xff] ^
+              crc32c_table[1][(w >> 48) & 0xff] ^ crc32c_table[0][w >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+/* Polynomial arithmetic mod P in the reflected representation (x^0 = bit 31) */
+static uint32_t crc32c_mulmod(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+/* x^n mod P */
+static uint32_t crc32c_xpow(uint64_t n) {
+    uint32_t r = 1u << 31, sq = 1u << 30;      /* 1, x */
+    for (; n; n >>= 1) {
+        if (n & 1) r = crc32c_mulmod(r, sq);
+        sq = crc32c_mulmod(sq, sq);
+    }
+    return r;
+}
+
+/* Stream lengths for the 3-way kernel: the long one covers a 4 KiB block in one
+ * round (3 * 1360 = 4080), the short one the tail and 512-byte blocks. */
+#define CRC32C_LONG   1360
+#define CRC32C_SHORT  168
+
+/* Fold constants: pclmul(crc, k) reduced by crc32 is crc * x^(8 * lane) mod P */
+static uint32_t crc32c_k_long, crc32c_k_short;
+
+static void crc32c_hw_init(void) {
+    /* reducing the reflected 64-bit carry-less product with crc32 multiplies by a
+     * further x^33, so the constant is x^(8*lane - 33) */
+    crc32c_k_long = crc32c_xpow(8 * CRC32C_LONG - 33);
+    crc32c_k_short = crc32c_xpow(8 * CRC32C_SHORT - 33);
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_fold(uint32_t crc, uint32_t k) {
+    __m128i p = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)crc), _mm_cvtsi32_si128((int)k), 0);
+    return (uint32_t)_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(p));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    uint64_t c0 = ~crc;
+    while (len && ((uintptr_t)p & 7)) {
+        c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+        len--;
+    }
+    for (size_t lane = CRC32C_LONG; lane >= CRC32C_SHORT; lane = CRC32C_SHORT) {
+        uint32_t k = lane == CRC32C_LONG ? crc32c_k_long : crc32c_k_short;
+        while (len >= 3 * lane) {
+            uint64_t c1 = 0, c2 = 0;
+            const uint8_t *end = p + lane;
+            for (; p < end; p += 8) {
+                uint64_t w0, w1, w2;
+                memcpy(&w0, p, 8);
+                memcpy(&w1, p + lane, 8);
+                memcpy(&w2, p + 2 * lane, 8);
+                c0 = _mm_crc32_u64(c0, w0);
+                c1 = _mm_crc32_u64(c1, w1);
+                c2 = _mm_crc32_u64(c2, w2);
+            }
+            /* stream 0 is followed by 2 lanes, stream 1 by 1 */
+            c0 = crc32c_fold(crc32c_fold((uint32_t)c0, k) ^ (uint32_t)c1, k) ^ (uint32_t)c2;
+            p += 2 * lane;
+            len -= 3 * lane;
+        }
+        if (lane == CRC32C_SHORT) break;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c0 = _mm_crc32_u64(c0, w);
+    }
+    while (len--) c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+    return ~(uint32_t)c0;
+}
+
+static int crc32c_have_hw(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+}
+
+#else
+
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) { return crc32c_sw(crc, buf, len); }
+static void crc32c_hw_init(void) {}
+static int crc32c_have_hw(void) { return 0; }
+
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t, const void *, size_t);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/* First call from any thread: build the tables and pick the kernel */
+static void crc32c_init(void) {
+    crc32c_table_init();
+    if (crc32c_have_hw()) {
+        crc32c_hw_init();
+        crc32c_impl = crc32c_hw;
+    } else {
+        crc32c_impl = crc32c_sw;
+    }
+}
+
+static uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_impl(crc, buf, len);
+}
+
+/* =========================
+ *   BITMAP FIND-FIRST-ZERO
+ * =========================
+ * Allocating an inode or data block looks for the first clear bit of a bitmap, that
+ * is the first byte that is not 0xff. ffz_bytes() dispatches once, on first use, to
+ * the widest kernel the CPU has: AVX2 (32 bytes per compare), SSE2 (16; every x86-64
+ * has it) or portable 64-bit words.
+ */
+
+/* Index of the first byte of p[0..n) that is not 0xff, n if there is none */
+static uint32_t ffz_bytes_sw(const uint8_t *p, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);                  /* little-endian: byte 0 is the low byte */
+        if (~w) return i + (uint32_t)__builtin_ctzll(~w) / 8;
+    }
+    while (i < n && p[i] == 0xff) i++;
+    return i;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+static uint32_t ffz_bytes_sse2(const uint8_t *p, uint32_t n) {
+    const __m128i ones = _mm_set1_epi8((char)0xff);
+    uint32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones));
+        if (m != 0xffff) return i + (uint32_t)__builtin_ctz(~m);
+    }
+    return i + ffz_bytes_sw(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static uint32_t ffz_bytes_avx2(const uint8_t *p, uint32_t n) {
+    const __m256i ones = _mm256_set1_epi8((char)0xff);
+    uint32_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ones));
+        if (m != 0xffffffffu) return i + (uint32_t)__builtin_ctz(~m);
+    }
+    return i + ffz_bytes_sse2(p + i, n - i);
+}
+
+static uint32_t (*ffz_pick(void))(const uint8_t *, uint32_t) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? ffz_bytes_avx2 : ffz_bytes_sse2;
+}
+
+#else
+
+static uint32_t (*ffz_pick(void))(const uint8_t *, uint32_t) {
+    return ffz_bytes_sw;
+}
+
+#endif
+
+/* Picked under pthread_once: threads of a shared handle may search bitmaps at once */
+static uint32_t (*ffz_impl)(const uint8_t *, uint32_t);
+static pthread_once_t ffz_once = PTHREAD_ONCE_INIT;
+
+static void ffz_init(void) {
+    ffz_impl = ffz_pick();
+}
+
+static uint32_t ffz_bytes(const uint8_t *p, uint32_t n) {
+    pthread_once(&ffz_once, ffz_init);
+    return ffz_impl(p, n);
+}
+
+/* =========================
+ *     BLOCK COMPRESSION
+ * =========================
+ * Run-length codec for ZDATA records. The stream is a sequence of tokens, each
+ * starting with a little-endian uint16_t h:
+ *   h & 0x8000: a run of (h & 0x7fff) copies of the byte that follows
+ *   otherwise:  h literal bytes follow
+ * Runs shorter than RLE_MIN_RUN stay in the literals. An all-zero 4 KiB block encodes
+ * to 3 bytes; bitmaps and sparse inode tables compress to tens of bytes.
+ */
+
+#define RLE_MAX_TOKEN 0x7fff
+#define RLE_MIN_RUN   5        /* a run token costs 3 bytes */
+
+static int rle_put(uint8_t *out, uint32_t *o, uint32_t cap, uint16_t h, const uint8_t *p, uint32_t n) {
+    if (*o + 2 + n > cap) return -1;
+    out[*o] = (uint8_t)h;
+    out[*o + 1] = (uint8_t)(h >> 8);
+    memcpy(out + *o + 2, p, n);
+    *o += 2 + n;
+    return 0;
+}
+
+/* Encode n bytes into at most cap bytes. Returns the encoded size, 0 if it does not fit. */
+static uint32_t rle_encode(const uint8_t *in, uint32_t n, uint8_t *out, uint32_t cap) {
+    uint32_t o = 0, lit = 0;   /* in[lit, i) are pending literals */
+    for (uint32_t i = 0; i < n;) {
+        uint32_t run = 1;
+        while (i + run < n && in[i + run] == in[i] && run < RLE_MAX_TOKEN) run++;
+        if (run < RLE_MIN_RUN && i + run < n) {
+            i += run;
+            continue;
+        }
+        if (run < RLE_MIN_RUN) {                /* short run at the very end: literals */
+            i += run;
+            run = 0;
+        }
+        while (lit < i) {
+            uint32_t m = i - lit < RLE_MAX_TOKEN ? i - lit : RLE_MAX_TOKEN;
+            if (rle_put(out, &o, cap, (uint16_t)m, in + lit, m) < 0) return 0;
+            lit += m;
+        }
+        if (run) {
+            if (rle_put(out, &o, cap, (uint16_t)(0x8000 | run), in + i, 1) < 0) return 0;
+            i += run;
+            lit = i;
+        }
+    }
+    return o;
+}
+
+/* Decode exactly n bytes. Returns 0, or -1 if the stream is malformed or sized wrong. */
+static int rle_decode(const uint8_t *in, uint32_t len, uint8_t *out, uint32_t n) {
+    uint32_t i = 0, o = 0;
+    while (i < len) {
+        if (len - i < 2) return -1;
+        uint16_t h = (uint16_t)(in[i] | in[i + 1] << 8);
+        uint32_t m = h & RLE_MAX_TOKEN;
+        i += 2;
+        if (m > n - o) return -1;
+        if (h & 0x8000) {
+            if (i == len) return -1;
+            memset(out + o, in[i++], m);
+        } else {
+            if (m > len - i) return -1;
+            memcpy(out + o, in + i, m);
+            i += m;
+        }
+        o += m;
+    }
+    return o == n ? 0 : -1;
+}
+
+/* Block buffers are block-aligned so they can be handed to O_DIRECT I/O */
+static void *xmalloc_block(void) {
+    void *p;
+    if (posix_memalign(&p, geo.block_size, geo.block_size) != 0) oom();
+    return p;
+}
+
+static off_t blk_off(uint32_t blkno) {
+    return (off_t)blkno * (off_t)geo.block_size;
+}
+
+/* All image I/O is positional, so committing threads and install workers can share
+ * the fd without sharing a file offset. These move the whole length, retrying on EINTR
+ * and after short transfers. They return len, less only when a read hits end of file
+ * or a write makes no progress, or -1 with errno set. */
+static ssize_t pread_full(int fd, void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, (uint8_t *)buf + done, len - done, off + (off_t)done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+static ssize_t pwrite_full(int fd, const void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, (const uint8_t *)buf + done, len - done, off + (off_t)done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+/* One pwritev; after a short one the rest goes segment by segment (rare) */
+static ssize_t pwritev_full(int fd, const struct iovec *iov, int iovcnt, off_t off) {
+    ssize_t n;
+    while ((n = pwritev(fd, iov, iovcnt, off)) < 0 && errno == EINTR) {}
+    if (n < 0) return -1;
+    size_t done = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size_t seg = iov[i].iov_len, skip = (size_t)n > done ? (size_t)n - done : 0;
+        if (skip < seg) {
+            ssize_t m = pwrite_full(fd, (const uint8_t *)iov[i].iov_base + skip, seg - skip,
+                                    off + (off_t)(done + skip));
+            if (m < 0) return -1;
+            if ((size_t)m < seg - skip) return (ssize_t)(done + skip + (size_t)m);
+        }
+        done += seg;
+    }
+    return (ssize_t)done;
+}
+
+/* --mmap: the image is mapped MAP_SHARED once at open. Reads and writes are then
+ * memcpy to and from the page cache, and barriers msync just the range written.
+ * NULL when all I/O goes through the fd. */
+static uint8_t *img_map;
+static size_t img_map_len;
+
+static int map_check(off_t off, size_t len, const char *what) {
+    if (off < 0 || (uint64_t)off + len > img_map_len)
+        return jfail(EIO, "%s: beyond the end of the image", what);
+    return 0;
+}
+
+static int map_read(void *dst, size_t len, off_t off, const char *what) {
+    int rc = map_check(off, len, what);
+    if (rc == 0) memcpy(dst, img_map + off, len);
+    return rc;
+}
+
+static int map_write(const void *src, size_t len, off_t off, const char *what) {
+    int rc = map_check(off, len, what);
+    if (rc == 0) memcpy(img_map + off, src, len);
+    return rc;
+}
+
+/* Write back the pages holding [off, off + len) of the mapping */
+static int map_sync(off_t off, size_t len, const char *what) {
+    uintptr_t pg = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t a = (uintptr_t)(img_map + off) & ~(pg - 1), e = (uintptr_t)(img_map + off + len);
+    int r;
+    while ((r = msync((void *)a, e - a, MS_SYNC)) < 0 && errno == EINTR) {}
+    return r < 0 ? jfail_io(what, -1) : 0;
+}
+
+/* Read/write full blocks (home blocks on disk) */
+static int read_block(int fd, uint32_t blkno, void *buf) {
+    if (img_map) return map_read(buf, geo.block_size, blk_off(blkno), "read_block");
+    ssize_t n = pread_full(fd, buf, geo.block_size, blk_off(blkno));
+    if (n != (ssize_t)geo.block_size) return jfail_io("read_block", n);
+    return 0;
+}
+
+static int write_block(int fd, uint32_t blkno, const void *buf) {
+    if (img_map) return map_write(buf, geo.block_size, blk_off(blkno), "write_block");
+    ssize_t n = pwrite_full(fd, buf, geo.block_size, blk_off(blkno));
+    if (n != (ssize_t)geo.block_size) return jfail_io("write_block", n);
+    return 0;
+}
+
+static int is_pow2(uint32_t x) {
+    return x != 0 && (x & (x - 1)) == 0;
+}
+
+/* Fill geo from the superblock; refuses layouts this tool cannot address safely. */
+static int geometry_load(int fd) {
+    struct superblock sb;
+    ssize_t n = pread_full(fd, &sb, sizeof(sb), 0);
+    if (n != (ssize_t)sizeof(sb)) return jfail_io("pread(superblock)", n);
+
+    if (sb.magic != FS_MAGIC)
+        return jfail(EINVAL, "bad superblock magic 0x%08x (run mkfs?)", sb.magic);
+    if (!is_pow2(sb.block_size) || sb.block_size < MIN_BLOCK_SIZE || sb.block_size > MAX_BLOCK_SIZE ||
+        sb.journal_block != JOURNAL_START_BLK ||
+        !(sb.journal_block + 2 <= sb.inode_bitmap && sb.inode_bitmap < sb.data_bitmap &&
+          sb.data_bitmap < sb.inode_start && sb.inode_start < sb.data_start &&
+          sb.data_start < sb.total_blocks))
+        return jfail(EINVAL, "unsupported superblock layout");
+
+    geo.block_size = sb.block_size;
+    geo.total_blocks = sb.total_blocks;
+    geo.inode_count = sb.inode_count;
+    geo.journal_start = sb.journal_block;
+    geo.journal_nblocks = sb.inode_bitmap - sb.journal_block;
+    geo.inode_bmap = sb.inode_bitmap;
+    geo.data_bmap = sb.data_bitmap;
+    geo.inode_tbl = sb.inode_start;
+    geo.inode_tbl_nblocks = sb.data_start - sb.inode_start;
+    geo.data_start = sb.data_start;
+    geo.data_nblocks = sb.total_blocks - sb.data_start;
+    geo.inodes_per_block = sb.block_size / (uint32_t)sizeof(struct inode);
+    geo.dirents_per_block = sb.block_size / (uint32_t)sizeof(struct dirent);
+
+    uint64_t jbytes = (uint64_t)geo.journal_nblocks * geo.block_size;
+    uint64_t bits = (uint64_t)geo.block_size * 8;
+    if (jbytes > UINT32_MAX ||
+        (uint64_t)geo.inode_count > (uint64_t)geo.inode_tbl_nblocks * geo.inodes_per_block ||
+        geo.inode_count > (uint64_t)(sb.data_bitmap - sb.inode_bitmap) * bits ||
+        geo.data_nblocks > (uint64_t)(sb.inode_start - sb.data_bitmap) * bits)
+        return jfail(EINVAL, "superblock sizes do not fit its layout");
+    geo.journal_bytes = (uint32_t)jbytes;
+    return 0;
+}
+
+/* =========================
+ *     IO_URING BACKEND
+ * =========================
+ * With --io-uring the writes of a transaction (its records and the barrier behind
+ * them) and the home-block writes of an install are queued on an io_uring and handed
+ * to the kernel with one io_uring_enter per batch, instead of one pwrite/fdatasync
+ * each. Raw syscalls, no liburing. Each thread gets its own ring on first use (rings
+ * are not thread-safe) and drops it when it exits. When the headers lack io_uring, or
+ * the kernel refuses it, uring_get() returns NULL and callers use pread/pwrite.
+ */
+
+#define URING_ENTRIES 128      /* SQEs per batch */
+
+static int use_uring;          /* --io-uring */
+
+#ifdef HAVE_IO_URING
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_sz, cq_sz, sqes_sz;
+    unsigned tail;             /* local SQ tail: queued up to here */
+    unsigned queued;           /* SQEs queued since the last submit */
+};
+
+static void uring_free(struct uring *r) {
+    if (r->sqes) munmap(r->sqes, r->sqes_sz);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_sz);
+    if (r->sq_ptr) munmap(r->sq_ptr, r->sq_sz);
+    close(r->fd);
+    free(r);
+}
+
+static struct uring *uring_new(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0) return NULL;
+    struct uring *r = xmalloc(sizeof(*r));
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_sz > r->sq_sz) r->sq_sz = r->cq_sz;
+        r->cq_sz = r->sq_sz;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                     IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) r->sq_ptr = NULL;
+    if (r->sq_ptr && (p.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_ptr = r->sq_ptr;
+    } else if (r->sq_ptr) {
+        r->cq_ptr = mmap(NULL, r->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                         IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) r->cq_ptr = NULL;
+    }
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (r->cq_ptr) {
+        r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                       IORING_OFF_SQES);
+        if (r->sqes == MAP_FAILED) r->sqes = NULL;
+    }
+    if (!r->sqes) {
+        uring_free(r);
+        return NULL;
+    }
+    uint8_t *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->tail = *r->sq_tail;
+    return r;
+}
+
+static pthread_key_t uring_key;
+static pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+static __thread struct uring *uring_tls;
+static __thread int uring_tls_failed;
+
+static void uring_key_destroy(void *r) {
+    uring_free(r);
+}
+
+static void uring_key_init(void) {
+    pthread_key_create(&uring_key, uring_key_destroy);
+}
+
+/* This thread's ring, NULL to use pread/pwrite */
+static struct uring *uring_get(void) {
+    if (!use_uring || uring_tls_failed) return NULL;
+    if (uring_tls) return uring_tls;
+    pthread_once(&uring_key_once, uring_key_init);
+    if (!(uring_tls = uring_new())) {
+        uring_tls_failed = 1;
+        return NULL;
+    }
+    pthread_setspecific(uring_key, uring_tls);
+    return uring_tls;
+}
+
+/* Drop the calling thread's ring (journal_close) */
+static void uring_put(void) {
+    if (uring_tls) {
+        pthread_setspecific(uring_key, NULL);
+        uring_free(uring_tls);
+    }
+    uring_tls = NULL;
+    uring_tls_failed = 0;
+}
+
+/* Queue one SQE. res is the result that counts as success (the byte count of a read
+ * or write, 0 for fsync); flags are IOSQE_* (IO_LINK: the next SQE waits for this
+ * one). Callers keep a batch within URING_ENTRIES. */
+static void uring_queue(struct uring *r, uint8_t op, int fd, const void *addr, uint32_t len,
+                        off_t off, uint32_t op_flags, uint8_t flags, uint32_t res) {
+    unsigned i = r->tail & *r->sq_mask;
+    struct io_uring_sqe *e = &r->sqes[i];
+    memset(e, 0, sizeof(*e));
+    e->opcode = op;
+    e->flags = flags;
+    e->fd = fd;
+    e->addr = (uint64_t)(uintptr_t)addr;
+    e->len = len;
+    e->off = (uint64_t)off;
+    e->fsync_flags = op_flags;     /* union with rw_flags */
+    e->user_data = res;
+    r->sq_array[i] = i;
+    r->tail++;
+    r->queued++;
+}
+
+static int uring_enter(struct uring *r, unsigned to_submit, unsigned min_complete) {
+    for (;;) {
+        int n = (int)syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete,
+                             min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0 || errno != EINTR) return n;
+    }
+}
+
+/* Submit everything queued and wait for all of it. The first SQE whose result is not
+ * what it was queued with fails the batch (what names it); SQEs linked behind a
+ * failed one complete with -ECANCELED and are not reported separately. */
+static int uring_submit_wait(struct uring *r, const char *what) {
+    unsigned n = r->queued, submitted = 0;
+    int rc = 0;
+    r->queued = 0;
+    __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+    while (submitted < n) {
+        int k = uring_enter(r, n - submitted, 0);
+        if (k <= 0) {
+            rc = jfail_io(what, k < 0 ? -1 : 0);
+            /* the kernel did not take the rest: take them back */
+            r->tail = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+            __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+            break;
+        }
+        submitted += (unsigned)k;
+    }
+    for (unsigned done = 0; done < submitted;) {
+        unsigned head = *r->cq_head;
+        if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            /* keep waiting even if this fails: in-flight I/O still uses the caller's buffers */
+            if (uring_enter(r, 0, 1) < 0 && rc == 0) rc = jfail_io(what, -1);
+            continue;
+        }
+        const struct io_uring_cqe *c = &r->cqes[head & *r->cq_mask];
+        if (rc == 0 && c->res != (int32_t)c->user_data)
+            rc = c->res < 0 ? jfail(-c->res, "%s: %s", what, strerror(-c->res))
+                            : jfail(EIO, "%s: short transfer", what);
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+        done++;
+    }
+    return rc;
+}
+
+#else /* !HAVE_IO_URING */
+
+struct uring;
+static struct uring *uring_get(void) { return NULL; }
+static void uring_put(void) {}
+
+#endif
+
+/* =========================
+ *    JOURNAL BYTE-ARRAY I/O
+ * =========================
+ * Journal is a byte array of size geo.journal_bytes starting at block geo.journal_start.
+ * journal_header is at offset 0 within this region, the circular log follows it.
+ * Header updates are done under flock(); install holds it for its whole checkpoint.
+ */
+
+/* O_DIRECT descriptor for block-format journal writes (--direct), -1 if unused */
+static int direct_fd = -1;
+
+static off_t journal_base_off(void) {
+    return blk_off(geo.journal_start);
+}
+
+static int journal_is_block_fmt(const struct journal_header *jh) {
+    return jh->version == JOURNAL_VERSION_BLOCK;
+}
+
+/* First byte of the circular log; an empty journal has nbytes_used == this */
+static uint32_t journal_log_start(const struct journal_header *jh) {
+    return journal_is_block_fmt(jh) ? geo.block_size : (uint32_t)sizeof(struct journal_header);
+}
+
+/* fd for writes into the log of this journal */
+static int journal_wfd(int fd, const struct journal_header *jh) {
+    return journal_is_block_fmt(jh) && direct_fd >= 0 ? direct_fd : fd;
+}
+
+/* Set by the daemon (journal_own): it holds the journal lock for its whole life, so
+ * nobody else changes the header and it is read from disk only once. The cache is
+ * copied in and out under jh_cache_lock, so threads always see a whole header. */
+static int journal_owned;
+static struct journal_header jh_cache;
+static int jh_cache_valid;
+static pthread_mutex_t jh_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int journal_read_header(int fd, struct journal_header *jh) {
+    pthread_mutex_lock(&jh_cache_lock);
+    int cached = jh_cache_valid;
+    if (cached) *jh = jh_cache;
+    pthread_mutex_unlock(&jh_cache_lock);
+    if (cached) return 0;
+    if (img_map) {
+        int rc = map_read(jh, sizeof(*jh), journal_base_off(), "journal_header");
+        if (rc < 0) return rc;
+    } else {
+        ssize_t n = pread_full(fd, jh, sizeof(*jh), journal_base_off());
+        if (n != (ssize_t)sizeof(*jh)) return jfail_io("pread(journal_header)", n);
+    }
+    if (journal_owned) {
+        pthread_mutex_lock(&jh_cache_lock);
+        jh_cache = *jh;
+        jh_cache_valid = 1;
+        pthread_mutex_unlock(&jh_cache_lock);
+    }
+    return 0;
+}
+
+static int journal_write_header(int fd, const struct journal_header *jh) {
+    /* the cache follows what was meant to be written; on failure the handle must be
+     * closed anyway, since the on-disk header is then unknown */
+    if (journal_owned) {
+        pthread_mutex_lock(&jh_cache_lock);
+        jh_cache = *jh;
+        jh_cache_valid = 1;
+        pthread_mutex_unlock(&jh_cache_lock);
+    }
+    if (img_map) return map_write(jh, sizeof(*jh), journal_base_off(), "journal_header");
+    if (journal_is_block_fmt(jh)) {
+        /* whole header block, so it can go through O_DIRECT like the rest of the log */
+        uint8_t *blk = xmalloc_block();
+        memset(blk, 0, geo.block_size);
+        memcpy(blk, jh, sizeof(*jh));
+        ssize_t n = pwrite_full(journal_wfd(fd, jh), blk, geo.block_size, journal_base_off());
+        free(blk);
+        if (n != (ssize_t)geo.block_size) return jfail_io("pwrite(journal_header block)", n);
+        return 0;
+    }
+    ssize_t n = pwrite_full(fd, jh, sizeof(*jh), journal_base_off());
+    if (n != (ssize_t)sizeof(*jh)) return jfail_io("pwrite(journal_header)", n);
+    return 0;
+}
+
+/* Header updates: jh_mutex between threads of this process, flock between processes
+ * (flock does not exclude threads sharing the fd). The flock is counted, so a create
+ * group can keep other processes out from its first read to its commit while the
+ * journal_lock calls it makes on the way take and drop only jh_mutex. */
+static pthread_mutex_t jh_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned flock_refs;
+
+static int journal_flock(int fd) {
+    if (journal_owned) return 0;
+    pthread_mutex_lock(&flock_mutex);
+    if (flock_refs == 0)
+        while (flock(fd, LOCK_EX) < 0)
+            if (errno != EINTR) {
+                pthread_mutex_unlock(&flock_mutex);
+                return jfail_io("flock(journal)", -1);
+            }
+    flock_refs++;
+    pthread_mutex_unlock(&flock_mutex);
+    return 0;
+}
+
+static void journal_funlock(int fd) {
+    if (journal_owned) return;
+    pthread_mutex_lock(&flock_mutex);
+    if (--flock_refs == 0) flock(fd, LOCK_UN);   /* closing the fd drops it anyway */
+    pthread_mutex_unlock(&flock_mutex);
+}
+
+static int journal_lock(int fd) {
+    pthread_mutex_lock(&jh_mutex);
+    int rc = journal_flock(fd);
+    if (rc < 0) pthread_mutex_unlock(&jh_mutex);
+    return rc;
+}
+
+static void journal_unlock(int fd) {
+    journal_funlock(fd);
+    pthread_mutex_unlock(&jh_mutex);
+}
+
+/* Take the journal lock for good; other processes block in journal_lock meanwhile */
+static int journal_own(int fd) {
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno == EWOULDBLOCK) return jfail(EBUSY, "image is in use by another process");
+        return jfail_io("flock(journal own)", -1);
+    }
+    journal_owned = 1;
+    return 0;
+}
+
+/* Flush policy (journal_options.sync) */
+enum sync_mode { SYNC_NONE = JOURNAL_SYNC_NONE, SYNC_COMMIT = JOURNAL_SYNC_COMMIT, SYNC_FULL = JOURNAL_SYNC_FULL };
+static enum sync_mode sync_mode = SYNC_NONE;
+
+/* Barrier: everything written to the image so far is on stable storage */
+static int journal_barrier(int fd, const char *what) {
+    int r;
+    while ((r = fdatasync(fd)) < 0 && errno == EINTR) {}
+    if (r < 0) return jfail_io(what, -1);
+    return 0;
+}
+
+/* Barrier for [off, off + len) of the image: msync of that range when mapped, else
+ * journal_barrier */
+static int journal_barrier_range(int fd, off_t off, size_t len, const char *what) {
+    return img_map ? map_sync(off, len, what) : journal_barrier(fd, what);
+}
+
+static int journal_header_barrier(int fd) {
+    return journal_barrier_range(fd, journal_base_off(), sizeof(struct journal_header),
+                                 "fdatasync(journal header)");
+}
+
+/* High-water mark for automatic checkpoints, in percent of the journal (checkpoint_pct),
+ * but never below one full group */
+static unsigned checkpoint_pct = 100;
+
+static uint32_t journal_free_bytes(const struct journal_header *jh) {
+    return geo.journal_bytes - jh->nbytes_used;
+}
+
+/* Place len contiguous bytes at tail (or at the log start behind a PAD when they would
+ * cross the end). Returns the bytes consumed including the pad, 0 if the journal is too full. */
+static uint32_t journal_reserve(const struct journal_header *jh, uint32_t len, uint32_t *off_out) {
+    uint32_t off = jh->tail, need = len;
+    if ((uint64_t)off + len > geo.journal_bytes) {
+        need += geo.journal_bytes - off;
+        off = journal_log_start(jh);
+    }
+    if (need > journal_free_bytes(jh)) return 0;
+    *off_out = off;
+    return need;
+}
+
+/* Journal write through the mapping. The transaction after it is synced on its own,
+ * so unless --sync=none this syncs its own range too. */
+static int journal_write_mapped(const void *src, size_t len, off_t at, const char *what) {
+    int rc = map_write(src, len, at, what);
+    if (rc == 0 && sync_mode != SYNC_NONE) rc = map_sync(at, len, what);
+    return rc;
+}
+
+/* Mark [tail, end of region) unused so the scan wraps to the log start */
+static int journal_write_pad(int fd, const struct journal_header *jh) {
+    off_t at = journal_base_off() + (off_t)jh->tail;
+    if (journal_is_block_fmt(jh)) {
+        if (jh->tail == geo.journal_bytes) return 0;
+        uint8_t *blk = xmalloc_block();
+        memset(blk, 0, geo.block_size);
+        struct jblock_header *pb = (struct jblock_header *)blk;
+        pb->magic = JOURNAL_MAGIC;
+        pb->type = REC_PAD;
+        int rc = 0;
+        if (img_map) {
+            rc = journal_write_mapped(blk, geo.block_size, at, "journal pad block");
+        } else {
+            ssize_t n = pwrite_full(journal_wfd(fd, jh), blk, geo.block_size, at);
+            if (n != (ssize_t)geo.block_size) rc = jfail_io("pwrite(journal pad block)", n);
+        }
+        free(blk);
+        return rc;
+    }
+    if (geo.journal_bytes - jh->tail < sizeof(struct rec_header)) return 0;
+    struct rec_header pad = { REC_PAD, (uint16_t)sizeof(struct rec_header) };
+    if (img_map) return journal_write_mapped(&pad, sizeof(pad), at, "journal pad");
+    ssize_t n = pwrite_full(fd, &pad, sizeof(pad), at);
+    if (n != (ssize_t)sizeof(pad)) return jfail_io("pwrite(journal pad)", n);
+    return 0;
+}
+
+/* Write a transaction's iov[] at off and, unless --sync=none, make it durable. With
+ * io_uring that is one WRITEV linked to an fdatasync in a single submission; mapped,
+ * a memcpy per iovec and an msync of the range. */
+static int journal_write_txn(int fd, const struct journal_header *jh, const struct iovec *iov,
+                             int iovcnt, uint32_t off, uint32_t len) {
+    int wfd = journal_wfd(fd, jh);
+    off_t at = journal_base_off() + (off_t)off;
+    if (img_map) {
+        int rc = map_check(at, len, "journal transaction");
+        for (int i = 0; i < iovcnt && rc == 0; i++) {
+            memcpy(img_map + at, iov[i].iov_base, iov[i].iov_len);
+            at += (off_t)iov[i].iov_len;
+        }
+        if (rc == 0 && sync_mode != SYNC_NONE) rc = map_sync(at - (off_t)len, len, "msync(journal transaction)");
+        return rc;
+    }
+#ifdef HAVE_IO_URING
+    struct uring *r = uring_get();
+    if (r) {
+        int sync = sync_mode != SYNC_NONE;
+        uring_queue(r, IORING_OP_WRITEV, wfd, iov, (uint32_t)iovcnt, at, 0, sync ? IOSQE_IO_LINK : 0, len);
+        if (sync) uring_queue(r, IORING_OP_FSYNC, fd, NULL, 0, 0, IORING_FSYNC_DATASYNC, 0, 0);
+        return uring_submit_wait(r, "io_uring(journal transaction)");
+    }
+#endif
+    ssize_t n = pwritev_full(wfd, iov, iovcnt, at);
+    if (n != (ssize_t)len) return jfail_io("pwritev(journal transaction)", n);
+    if (sync_mode != SYNC_NONE) return journal_barrier(fd, "fdatasync(journal transaction)");
+    return 0;
+}
+
+/* Append iov[] at tail in ONE pwritev and advance tail/nbytes_used (must write header
+ * yourself). Unless --sync=none the transaction is made durable before the caller's
+ * header update; records and COMMIT need no barrier between them because the COMMIT's
+ * checksum exposes a torn transaction to install. */
+static int journal_append_iov(int fd, struct journal_header *jh, const struct iovec *iov, int iovcnt,
+                              uint32_t len) {
+    uint32_t off;
+    uint32_t need = journal_reserve(jh, len, &off);
+    if (need == 0)
+        return jfail(ENOSPC, "journal full: %u bytes needed, %u free", len, journal_free_bytes(jh));
+    int rc;
+    if (off != jh->tail && (rc = journal_write_pad(fd, jh)) < 0) return rc;
+
+    if ((rc = journal_write_txn(fd, jh, iov, iovcnt, off, len)) < 0) return rc;
+
+    jh->tail = off + len;
+    jh->nbytes_used += need;
+    return 0;
+}
+
+/* ----- concurrent append (exclusive handles) -----
+ * When this process owns the journal, the header changes only here and in
+ * journal_checkpoint, so appends need no lock around their writes. A committing thread
+ * claims its byte range and sequence number with one compare-and-swap on app.pos,
+ * writes its records with pwritev while other threads do the same, and then reports
+ * to the publish step. Publishing advances the header over every finished claim in
+ * sequence order and writes it once for all of them. A claim that is still being
+ * written holds back the ones after it, so the on-disk tail only covers complete
+ * transactions. (A plain fetch-add cannot do it: a transaction must not cross the end
+ * of the region, so it may need a PAD first, and it must not overrun head.)
+ */
+
+#define APPEND_RING 64         /* claims in flight before new ones wait */
+
+struct append_done {
+    uint32_t end;              /* tail after this transaction */
+    int rc;                    /* < 0: its records could not be written */
+    int done;
+};
+
+static struct {
+    uint64_t pos;              /* tail | next_seq << 32 of the last claim */
+    uint64_t headpos;          /* head | head_seq << 32 of the last checkpoint */
+    uint32_t published;        /* first sequence number the header does not cover */
+    int broken;                /* a claim failed: the log has a hole, nothing more is published */
+    struct append_done ring[APPEND_RING];   /* by seq % APPEND_RING, under jh_mutex */
+    pthread_cond_t cond;       /* published or broken changed (with jh_mutex) */
+} app = { .cond = PTHREAD_COND_INITIALIZER };
+
+static uint64_t pos_pack(uint32_t off, uint32_t seq) {
+    return (uint64_t)seq << 32 | off;
+}
+
+/* nbytes_used for jh's head and tail; head_seq == next_seq tells an empty log from a
+ * full one when they meet */
+static uint32_t journal_used_bytes(const struct journal_header *jh) {
+    if (jh->tail > jh->head || (jh->tail == jh->head && jh->head_seq == jh->next_seq))
+        return journal_log_start(jh) + jh->tail - jh->head;
+    return geo.journal_bytes - jh->head + jh->tail;
+}
+
+static void journal_append_init(const struct journal_header *jh) {
+    app.pos = pos_pack(jh->tail, jh->next_seq);
+    app.headpos = pos_pack(jh->head, jh->head_seq);
+    app.published = jh->next_seq;
+    app.broken = 0;
+    memset(app.ring, 0, sizeof(app.ring));
+}
+
+static int journal_append_broken(void) {
+    int broken = __atomic_load_n(&app.broken, __ATOMIC_ACQUIRE);
+    return jfail(-broken, "journal: an earlier transaction could not be written, reopen the image");
+}
+
+/* Claim len bytes at the tail (behind a PAD at *old_tail if they would cross the end)
+ * and the next sequence number. Returns 0, -ENOSPC, or an error if the log is broken. */
+static int journal_append_claim(const struct journal_header *jh, uint32_t len,
+                                uint32_t *off, uint32_t *seq, uint32_t *old_tail) {
+    for (;;) {
+        if (__atomic_load_n(&app.broken, __ATOMIC_ACQUIRE)) return journal_append_broken();
+        /* head is loaded first: an older head only makes the free space look smaller */
+        uint64_t hp = __atomic_load_n(&app.headpos, __ATOMIC_ACQUIRE);
+        uint64_t cur = __atomic_load_n(&app.pos, __ATOMIC_ACQUIRE);
+        struct journal_header v = *jh;          /* for the format */
+        v.head = (uint32_t)hp;
+        v.head_seq = (uint32_t)(hp >> 32);
+        v.tail = (uint32_t)cur;
+        v.next_seq = (uint32_t)(cur >> 32);
+        if (v.next_seq - __atomic_load_n(&app.published, __ATOMIC_ACQUIRE) >= APPEND_RING) {
+            sched_yield();
+            continue;
+        }
+        v.nbytes_used = journal_used_bytes(&v);
+        if (journal_reserve(&v, len, off) == 0) return -ENOSPC;
+        if (__atomic_compare_exchange_n(&app.pos, &cur, pos_pack(*off + len, v.next_seq + 1), 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *seq = v.next_seq;
+            *old_tail = v.tail;
+            return 0;
+        }
+    }
+}
+
+/* Report claim seq as written up to end (rc < 0: it was not) and wait until the header
+ * covers it. Whoever gets jh_mutex publishes every claim finished by then. */
+static int journal_append_publish(int fd, uint32_t seq, uint32_t end, int rc) {
+    pthread_mutex_lock(&jh_mutex);
+    struct append_done *d = &app.ring[seq % APPEND_RING];
+    d->end = end;
+    d->rc = rc;
+    d->done = 1;
+
+    struct journal_header jh;
+    journal_read_header(fd, &jh);             /* cached: cannot fail */
+    uint32_t pub = app.published;
+    while (!app.broken && app.ring[pub % APPEND_RING].done) {
+        d = &app.ring[pub % APPEND_RING];
+        d->done = 0;
+        if (d->rc < 0) {
+            __atomic_store_n(&app.broken, d->rc, __ATOMIC_RELEASE);
+            break;
+        }
+        jh.tail = d->end;
+        pub++;
+    }
+    if (pub != app.published) {
+        jh.next_seq = pub;
+        jh.nbytes_used = journal_used_bytes(&jh);
+        int wrc = journal_write_header(fd, &jh);
+        if (wrc == 0 && sync_mode == SYNC_FULL) wrc = journal_header_barrier(fd);
+        if (wrc < 0) __atomic_store_n(&app.broken, wrc, __ATOMIC_RELEASE);
+        else __atomic_store_n(&app.published, pub, __ATOMIC_RELEASE);
+    }
+    pthread_cond_broadcast(&app.cond);
+    while ((int32_t)(seq - app.published) >= 0 && !app.broken) pthread_cond_wait(&app.cond, &jh_mutex);
+    int ok = (int32_t)(seq - app.published) < 0;
+    pthread_mutex_unlock(&jh_mutex);
+    if (rc < 0) return rc;
+    return ok ? 0 : journal_append_broken();
+}
+
+/* Read bytes from journal (used by install scan) */
+static int journal_read_bytes(int fd, uint32_t offset, void *dst, uint32_t len) {
+    if ((uint64_t)offset + (uint64_t)len > (uint64_t)geo.journal_bytes)
+        return jfail(EIO, "journal read out of bounds");
+    if (img_map) return map_read(dst, len, journal_base_off() + (off_t)offset, "journal_read_bytes");
+    ssize_t n = pread_full(fd, dst, len, journal_base_off() + (off_t)offset);
+    if (n != (ssize_t)len) return jfail_io("pread(journal_read_bytes)", n);
+    return 0;
+}
+
+/* Format used when this process has to initialize a journal (journal_mkfs format) */
+static uint32_t new_journal_version = JOURNAL_VERSION;
+
+/* Initialize journal if not initialized */
+static int journal_init_if_needed(int fd) {
+    struct journal_header jh;
+    int rc = journal_read_header(fd, &jh);
+    if (rc < 0) return rc;
+
+    if (jh.magic == JOURNAL_MAGIC &&
+        (jh.version == JOURNAL_VERSION_RECORD || jh.version == JOURNAL_VERSION_BLOCK))
+        return 0;
+
+    /* an empty journal of an older version is upgraded within its family; a non-empty
+     * one must be installed by the tool that wrote it */
+    uint32_t version = new_journal_version;
+    if (jh.magic == JOURNAL_MAGIC) {
+        uint32_t empty = 0;
+        if (jh.version == 2 || jh.version == 4 || jh.version == 6) {
+            empty = sizeof(jh);                 /* same header, fewer record types */
+            version = JOURNAL_VERSION_RECORD;
+        } else if (jh.version == 3) {
+            empty = geo.block_size;
+            version = JOURNAL_VERSION_BLOCK;
+        } else {
+            empty = 2 * sizeof(uint32_t);       /* v1 header was { magic, nbytes_used } */
+        }
+        if (jh.nbytes_used != empty)
+            return jfail(EPROTO, "pending transactions in an older journal format, install them first");
+    }
+    memset(&jh, 0, sizeof(jh));
+    jh.magic = JOURNAL_MAGIC;
+    jh.version = version;
+    jh.nbytes_used = journal_log_start(&jh);  /* empty: nothing past the log start */
+    jh.head = jh.nbytes_used;
+    jh.tail = jh.nbytes_used;
+    return journal_write_header(fd, &jh);
+}
+
+/* =========================
+ *   TRANSACTION BUILDER
+ * =========================
+ * Collects all records of one transaction in memory:
+ *   record format: DATA(block_no, image) / ZDATA / DELTA(block_no, range) ... COMMIT
+ *   block format:  DESC(block_no...) image ... image COMMIT  (full images only)
+ * and submits them with a single pwritev at journal_base_off() + tail,
+ * followed by one journal_write_header(). Block images are referenced, not copied,
+ * so they must stay valid until txn_commit(). The layout is chosen in txn_commit(),
+ * once the header (and so the journal format) has been read under the lock.
+ * struct txn is also the library's struct journal_txn (journal_txn_begin).
+ */
+
+#define TXN_MAX_BLOCKS 64      /* blocks per transaction */
+#define DELTA_MAX_RANGES 4     /* DELTA records per block before a full DATA image is cheaper */
+#define TXN_MAX_RECS (TXN_MAX_BLOCKS * DELTA_MAX_RANGES)   /* 2 * 256 + 1 iovecs < IOV_MAX */
+
+static int full_images;        /* journal_options.full_images: DATA records only */
+
+/* rec_header + block_no: the fixed part in front of each DATA record's image */
+struct data_rec_prefix {
+    struct rec_header hdr;
+    uint32_t block_no;
+};
+
+union rec_prefix {
+    struct data_rec_prefix data;
+    struct delta_rec_prefix delta;
+    struct zdata_rec_prefix zdata;
+};
+
+struct txn {
+    uint32_t block_no[TXN_MAX_RECS];
+    const void *image[TXN_MAX_RECS];       /* full image, or the bytes of a delta */
+    union rec_prefix pre[TXN_MAX_RECS];
+    uint16_t offset[TXN_MAX_RECS];
+    uint16_t length[TXN_MAX_RECS];         /* 0: full image */
+    struct commit_record commit;
+    struct iovec iov[2 * TXN_MAX_RECS + 2];
+    int nrecs;
+    int ndelta;
+    struct journal *j;                     /* owner, for journal_txn_commit */
+};
+
+/* Upper bound on the bytes a transaction of nblocks blocks takes in this journal
+ * (exact when every block is logged as a full image) */
+static uint32_t txn_bytes(const struct journal_header *jh, int nblocks) {
+    if (journal_is_block_fmt(jh)) return ((uint32_t)nblocks + 2) * geo.block_size;
+    return (uint32_t)nblocks * (uint32_t)DATA_REC_SIZE + (uint32_t)COMMIT_REC_SIZE;
+}
+
+static void txn_begin(struct txn *t) {
+    t->nrecs = 0;
+    t->ndelta = 0;
+}
+
+static int txn_add(struct txn *t, uint32_t home_block_no, const void *bytes, uint16_t offset, uint16_t length) {
+    if (t->nrecs == TXN_MAX_RECS)
+        return jfail(E2BIG, "txn: more than %d records in one transaction", TXN_MAX_RECS);
+    int i = t->nrecs++;
+    t->block_no[i] = home_block_no;
+    t->image[i] = bytes;
+    t->offset[i] = offset;
+    t->length[i] = length;
+    return i;
+}
+
+/* Add one block image; logging the same home block twice is a caller bug. */
+static int txn_log_block(struct txn *t, uint32_t home_block_no, const void *block_image) {
+    int rc = txn_add(t, home_block_no, block_image, 0, 0);
+    return rc < 0 ? rc : 0;
+}
+
+/* Add bytes [offset, offset + length) of a block (record format only). The bytes are
+ * referenced like images. A block's ranges are applied in the order they are logged. */
+static int txn_log_delta(struct txn *t, uint32_t home_block_no, const void *bytes,
+                         uint32_t offset, uint32_t length) {
+    if (length == 0 || offset + length > geo.block_size)
+        return jfail(EINVAL, "txn: bad delta %u+%u for block %u", offset, length, home_block_no);
+    int rc = txn_add(t, home_block_no, bytes, (uint16_t)offset, (uint16_t)length);
+    if (rc < 0) return rc;
+    t->ndelta++;
+    return 0;
+}
+
+/* Checksum of a transaction: CRC32C of its sequence number followed by every byte
+ * before the COMMIT (DATA/DELTA records, or DESC block + images). */
+static uint32_t txn_csum(uint32_t seq, const struct iovec *iov, int n) {
+    uint32_t crc = crc32c(0, &seq, sizeof(seq));
+    for (int i = 0; i < n; i++) crc = crc32c(crc, iov[i].iov_base, iov[i].iov_len);
+    return crc;
+}
+
+/* Record format: DATA (or ZDATA, when the image compresses and full_images is off)
+ * prefix + image, or DELTA prefix + bytes per record, COMMIT record. zbuf holds one
+ * block per record for the compressed images. Returns iovcnt; *len is set to the bytes
+ * they take. The sequence number and checksum are filled in by txn_seal. */
+static int txn_build_records(struct txn *t, uint8_t *zbuf, uint32_t *len) {
+    int k = 0;
+    *len = (uint32_t)COMMIT_REC_SIZE;
+    for (int i = 0; i < t->nrecs; i++) {
+        union rec_prefix *p = &t->pre[i];
+        uint8_t *z = zbuf + (size_t)i * geo.block_size;
+        uint32_t zlen = 0;
+        p->data.block_no = t->block_no[i];
+        t->iov[k].iov_base = p;
+        t->iov[k + 1].iov_base = (void *)t->image[i];
+        if (t->length[i] != 0) {
+            p->delta.hdr.type = REC_DELTA;
+            p->delta.hdr.size = (uint16_t)DELTA_REC_SIZE(t->length[i]);
+            p->delta.offset = t->offset[i];
+            p->delta.length = t->length[i];
+            t->iov[k].iov_len = sizeof(p->delta);
+            t->iov[k + 1].iov_len = t->length[i];
+        } else if (!full_images &&
+                   (zlen = rle_encode(t->image[i], geo.block_size, z,
+                                      (uint32_t)(DATA_REC_SIZE - ZDATA_REC_SIZE(1)))) != 0) {
+            p->zdata.hdr.type = REC_ZDATA;
+            p->zdata.hdr.size = (uint16_t)ZDATA_REC_SIZE(zlen);
+            p->zdata.codec = ZCODEC_RLE;
+            p->zdata.zlen = (uint16_t)zlen;
+            t->iov[k].iov_len = sizeof(p->zdata);
+            t->iov[k + 1].iov_base = z;
+            t->iov[k + 1].iov_len = zlen;
+        } else {
+            p->data.hdr.type = REC_DATA;
+            p->data.hdr.size = (uint16_t)DATA_REC_SIZE;
+            t->iov[k].iov_len = sizeof(p->data);
+            t->iov[k + 1].iov_len = geo.block_size;
+        }
+        *len += (uint32_t)(t->iov[k].iov_len + t->iov[k + 1].iov_len);
+        k += 2;
+    }
+    t->commit.hdr.type = REC_COMMIT;
+    t->commit.hdr.size = (uint16_t)COMMIT_REC_SIZE;
+    t->iov[k].iov_base = &t->commit;
+    t->iov[k++].iov_len = sizeof(t->commit);
+    return k;
+}
+
+/* Block format: DESC block, images, COMMIT block. desc/commit are block buffers. With
+ * O_DIRECT, images that are not block aligned are copied to bounce (one block per
+ * record); bounce is NULL otherwise. */
+static int txn_build_blocks(struct txn *t, uint8_t *desc, uint8_t *commit, uint8_t *bounce) {
+    memset(desc, 0, geo.block_size);
+    struct jblock_header *dh = (struct jblock_header *)desc;
+    dh->magic = JOURNAL_MAGIC;
+    dh->type = REC_DESC;
+    dh->count = (uint32_t)t->nrecs;
+    memcpy(dh + 1, t->block_no, (size_t)t->nrecs * sizeof(uint32_t));
+
+    memset(commit, 0, geo.block_size);
+    struct jblock_header *ch = (struct jblock_header *)commit;
+    ch->magic = JOURNAL_MAGIC;
+    ch->type = REC_COMMIT;
+
+    int k = 0;
+    t->iov[k].iov_base = desc;
+    t->iov[k++].iov_len = geo.block_size;
+    for (int i = 0; i < t->nrecs; i++) {
+        const void *img = t->image[i];
+        if (bounce && ((uintptr_t)img & (geo.block_size - 1)) != 0) {
+            uint8_t *b = bounce + (size_t)i * geo.block_size;
+            memcpy(b, img, geo.block_size);
+            img = b;
+        }
+        t->iov[k].iov_base = (void *)img;
+        t->iov[k++].iov_len = geo.block_size;
+    }
+    t->iov[k].iov_base = commit;
+    t->iov[k++].iov_len = geo.block_size;
+    return k;
+}
+
+/* Stamp a built transaction with its sequence number and checksum everything before
+ * the COMMIT */
+static void txn_seal(struct txn *t, int iovcnt, uint32_t seq, int block_fmt) {
+    if (block_fmt) {
+        struct jblock_header *dh = t->iov[0].iov_base, *ch = t->iov[iovcnt - 1].iov_base;
+        dh->seq = seq;
+        ch->seq = seq;
+        ch->csum = txn_csum(seq, t->iov, iovcnt - 1);
+    } else {
+        t->commit.seq = seq;
+        t->commit.csum = txn_csum(seq, t->iov, iovcnt - 1);
+    }
+}
+
+static int journal_checkpoint(int fd, struct journal_install_stats *st);
+static int journal_checkpoint_to(int fd, struct journal_install_stats *st, uint32_t low);
+static int ckpt_bg_kick(void);
+
+/* Owned journal: claim, write and publish without holding the lock while writing
+ * (see concurrent append). Checkpoints until the claim fits. */
+static int txn_commit_owned(int fd, struct journal_header *jh, struct txn *t, int iovcnt, uint32_t len) {
+    uint32_t off = 0, seq = 0, old_tail = 0;
+    int rc;
+    while ((rc = journal_append_claim(jh, len, &off, &seq, &old_tail)) == -ENOSPC)
+        if ((rc = journal_checkpoint(fd, NULL)) < 0) return rc;
+    if (rc < 0) return rc;
+
+    txn_seal(t, iovcnt, seq, journal_is_block_fmt(jh));
+    if (off != old_tail) {
+        struct journal_header v = *jh;
+        v.tail = old_tail;
+        rc = journal_write_pad(fd, &v);
+    }
+    if (rc == 0) rc = journal_write_txn(fd, jh, t->iov, iovcnt, off, len);
+    rc = journal_append_publish(fd, seq, off + len, rc);
+    journal_read_header(fd, jh);
+    return rc;
+}
+
+/* Seal with COMMIT, write all records with one pwritev, then update the header once.
+ * The records are built (and compressed) before taking the lock; jh only has to give
+ * the journal format on entry and is refreshed. */
+static int txn_commit(int fd, struct journal_header *jh, struct txn *t) {
+    uint8_t *desc = NULL, *commit = NULL, *zbuf = NULL;
+    int iovcnt, rc = 0;
+    uint32_t len;
+    if (journal_is_block_fmt(jh)) {
+        if (t->ndelta > 0 || (uint32_t)t->nrecs > DESC_MAX_BLOCKS)
+            return jfail(E2BIG, "txn: transaction does not fit the block journal format");
+        desc = xmalloc_block();
+        commit = xmalloc_block();
+        if (direct_fd >= 0 && posix_memalign((void **)&zbuf, geo.block_size,
+                                             (size_t)t->nrecs * geo.block_size) != 0)
+            oom();
+        iovcnt = txn_build_blocks(t, desc, commit, zbuf);
+        len = txn_bytes(jh, t->nrecs);
+    } else {
+        zbuf = xmalloc((size_t)t->nrecs * geo.block_size);
+        iovcnt = txn_build_records(t, zbuf, &len);
+    }
+
+    /* an empty log is contiguous, so anything smaller than it fits after a checkpoint */
+    if (len > geo.journal_bytes - journal_log_start(jh)) {
+        rc = jfail(ENOSPC, "txn: %u bytes do not fit the journal", len);
+        goto done;
+    }
+    if (journal_owned) {
+        rc = txn_commit_owned(fd, jh, t, iovcnt, len);
+        goto done;
+    }
+    /* other threads or processes may have filled the log since the caller made room */
+    for (int tries = 0;; tries++) {
+        if (tries > 0 && (rc = journal_checkpoint(fd, NULL)) < 0) break;
+        if ((rc = journal_lock(fd)) < 0) break;
+        if ((rc = journal_read_header(fd, jh)) == 0) {
+            txn_seal(t, iovcnt, jh->next_seq, journal_is_block_fmt(jh));
+            rc = journal_append_iov(fd, jh, t->iov, iovcnt, len);
+        }
+        if (rc == 0) {
+            jh->next_seq++;
+            if ((rc = journal_write_header(fd, jh)) == 0 && sync_mode == SYNC_FULL)
+                rc = journal_header_barrier(fd);
+        }
+        journal_unlock(fd);
+        if (rc != -ENOSPC) break;
+    }
+done:
+    free(desc);
+    free(commit);
+    free(zbuf);
+    return rc;
+}
+
+/* =========================
+ *   AUTOMATIC CHECKPOINT
+ * =========================
+ * Appenders check for room up front. If the transaction would not fit, or would push
+ * the journal past the --checkpoint-at high-water mark, the committed transactions are
+ * installed first (same code as the install command) and then the append goes ahead.
+ * With a background checkpointer, passing the high-water mark only wakes it, and an
+ * appender checkpoints itself only when the journal is full.
+ */
+
+/* Checkpoints of this process, one at a time (ckpt_mutex): ckpt_started counts those
+ * begun, ckpt_gen is the last one that installed everything it found, so blocks
+ * journaled before it started are now home. Read without a lock by the metadata cache. */
+static pthread_mutex_t ckpt_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t ckpt_started, ckpt_gen;
+
+static int journal_wants_checkpoint(const struct journal_header *jh, uint32_t len) {
+    uint32_t off;
+    uint32_t need = journal_reserve(jh, len, &off);
+    uint64_t hwm = (uint64_t)geo.journal_bytes * checkpoint_pct / 100;
+    /* a group must fit below it, or a small checkpoint_pct checkpoints every create */
+    uint64_t floor = (uint64_t)journal_log_start(jh) + txn_bytes(jh, TXN_MAX_BLOCKS);
+    if (hwm < floor) hwm = floor;
+    if (need == 0) return 1;
+    return (uint64_t)jh->nbytes_used + need > hwm && !ckpt_bg_kick();
+}
+
+/* Checkpoint if appending len bytes needs it; jh is refreshed. Returns 1 if it ran. */
+static int journal_make_room(int fd, struct journal_header *jh, uint32_t len) {
+    if (!journal_wants_checkpoint(jh, len)) return 0;
+    int rc;
+    /* jh may predate what the background checkpointer freed since */
+    if (ckpt_bg_kick() &&
+        ((rc = journal_read_header(fd, jh)) < 0 || !journal_wants_checkpoint(jh, len)))
+        return rc < 0 ? rc : 0;
+    rc = journal_checkpoint(fd, NULL);
+    if (rc < 0 || (rc = journal_read_header(fd, jh)) < 0) return rc;
+    return 1;
+}
+
+/* ----- background checkpointer -----
+ * journal_options.background_checkpoint: a thread that checkpoints the oldest
+ * transactions, down to checkpoint_low_pct of the journal, whenever an appender finds
+ * the journal past the high-water mark. A pass that fails leaves the log as it was;
+ * the appender that next finds the journal full checkpoints itself and gets the error.
+ */
+static struct {
+    int running;               /* thread started (set and cleared with no appenders about) */
+    int kicked, stop;
+    int fd;
+    uint32_t low;              /* nbytes_used to stop at */
+    unsigned passes;           /* checkpoints that installed something */
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ckpt_bg = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/* Wake the background checkpointer. Returns 0 if there is none. */
+static int ckpt_bg_kick(void) {
+    if (!ckpt_bg.running) return 0;
+    if (!__atomic_load_n(&ckpt_bg.kicked, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&ckpt_bg.lock);
+        __atomic_store_n(&ckpt_bg.kicked, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&ckpt_bg.cond);
+        pthread_mutex_unlock(&ckpt_bg.lock);
+    }
+    return 1;
+}
+
+static void *ckpt_bg_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&ckpt_bg.lock);
+    for (;;) {
+        while (!ckpt_bg.kicked && !ckpt_bg.stop) pthread_cond_wait(&ckpt_bg.cond, &ckpt_bg.lock);
+        if (ckpt_bg.stop) break;
+        __atomic_store_n(&ckpt_bg.kicked, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&ckpt_bg.lock);
+        int rc = journal_checkpoint_to(ckpt_bg.fd, NULL, ckpt_bg.low);
+        pthread_mutex_lock(&ckpt_bg.lock);
+        if (rc > 0) ckpt_bg.passes++;
+    }
+    pthread_mutex_unlock(&ckpt_bg.lock);
+    return NULL;
+}
+
+static int ckpt_bg_start(int fd, unsigned low_pct) {
+    ckpt_bg.fd = fd;
+    ckpt_bg.low = (uint32_t)((uint64_t)geo.journal_bytes * low_pct / 100);
+    ckpt_bg.kicked = ckpt_bg.stop = 0;
+    ckpt_bg.passes = 0;
+    int err = pthread_create(&ckpt_bg.tid, NULL, ckpt_bg_main, NULL);
+    if (err != 0) return jfail(err, "pthread_create(checkpointer): %s", strerror(err));
+    ckpt_bg.running = 1;
+    return 0;
+}
+
+static void ckpt_bg_stop(void) {
+    if (!ckpt_bg.running) return;
+    pthread_mutex_lock(&ckpt_bg.lock);
+    ckpt_bg.stop = 1;
+    pthread_cond_signal(&ckpt_bg.cond);
+    pthread_mutex_unlock(&ckpt_bg.lock);
+    pthread_join(ckpt_bg.tid, NULL);
+    ckpt_bg.running = 0;
+}
+
+/* =========================
+ *          CREATE
+ * =========================
+ * A create computes the updated metadata blocks for a new file in the root directory
+ * in memory and logs only those, sealed by a COMMIT; it never writes them home (that
+ * is install's job).
+ *
+ * Modified blocks: inode bitmap, inode table block(s) (new inode + root inode size/mtime),
+ * root directory block, plus data bitmap + new directory block when the root directory
+ * has to grow. A create is planned first (which blocks, which inode, which slot) and
+ * then applied to a meta_set; everything dirty goes out as one transaction (see
+ * TRANSACTION BUILDER). create-batch applies many creates to the same meta_set,
+ * so each block is logged once per group no matter how many files touched it.
+ */
+
+#define CREATE_MAX_BLOCKS   5   /* root inode tbl blk, inode bitmap, new inode tbl blk, dir blk, data bitmap */
+#define MIN_JOURNAL_NBLOCKS JOURNAL_MIN_JOURNAL_BLOCKS   /* header + DESC + CREATE_MAX_BLOCKS images + COMMIT */
+#define META_MIN_BLOCKS     (TXN_MAX_BLOCKS + 32)   /* a full txn plus one create's reads */
+#define META_CACHE_BYTES    (4u << 20)             /* cache size when that is more blocks */
+
+/* Metadata block cache, keyed by block number (hash chains) with an LRU list; blocks
+ * are read from home on first use and then served from memory for the life of the
+ * handle. A cached block is
+ *   dirty      changed in memory and not logged yet; stays until meta_commit
+ *   journaled  logged, but home may still be older (journaled > ckpt_gen); not evicted,
+ *              since reading it back would see stale contents
+ *   clean      same as home; evicted least recently used first
+ * Pointers from meta_get() stay valid for the rest of one create: eviction takes the
+ * least recently used block, and a create touches far fewer than META_MIN_BLOCKS -
+ * TXN_MAX_BLOCKS blocks. The lookups return NULL on an I/O error and leave the error
+ * code in err. */
+struct meta_ent {
+    uint32_t blkno;
+    uint8_t dirty;
+    uint8_t has_base;
+    int hnext;                 /* hash chain, -1 ends */
+    int prev, next;            /* LRU list, most recent first */
+    uint32_t enc;              /* dirty: bytes of its records in the open group */
+    uint64_t journaled;        /* > ckpt_gen: committed, maybe not home yet */
+    uint8_t *buf;
+    uint8_t *base;             /* contents as of the last commit (delta base) */
+};
+
+/* Journal overlay (see INSTALL): newest committed images of blocks not installed yet */
+struct overlay;
+static struct overlay *overlay_new(void);
+static void overlay_free(struct overlay *ov);
+static void overlay_invalidate(struct overlay *ov);
+static int overlay_read(struct overlay *ov, int fd, uint32_t blkno, uint8_t *buf);
+
+/* Free-space summary of one bitmap (see bitmap_find_zero) */
+struct bitmap_sum {
+    uint32_t first_blk, nbits;
+    uint32_t nblks;            /* bitmap blocks */
+    int built;
+    uint32_t *nfree;           /* clear bits per bitmap block */
+    uint8_t *full;             /* bit w set: 64-bit word w of the bitmap has no clear bit */
+    uint32_t hint;             /* no clear bit below this one */
+};
+
+/* Name index of the root directory (see dir_index_build) */
+struct dir_ent {
+    uint32_t hash;
+    uint32_t slot;             /* dirent index in the directory, + 1; 0 = empty */
+    uint32_t blkno;            /* directory block holding it */
+};
+
+struct dir_index {
+    int built;
+    uint32_t n, mask;          /* entries, table size - 1 */
+    struct dir_ent *tab;       /* open addressing, linear probing */
+    uint32_t next_free;        /* no free dirent below this index */
+};
+
+struct meta_set {
+    int fd;
+    int err;
+    int cap;                   /* slots */
+    int nblocks;               /* slots in use */
+    int ndirty;
+    struct meta_ent *e;
+    int *dirty_list;           /* slots of the dirty blocks, in the order they got dirty */
+    int *hash;                 /* chain heads */
+    uint32_t hmask;
+    int lru_head, lru_tail;
+    unsigned hits, misses;     /* meta_get: served from memory / read from journal or home */
+    struct overlay *ov;
+    uint32_t enc_bytes;        /* enc of the dirty blocks (record format, meta_txn_bytes) */
+    uint8_t *zbuf;             /* meta_enc_bytes scratch */
+    struct bitmap_sum isum, dsum;     /* inode and data bitmaps */
+    struct dir_index dx;              /* root directory */
+};
+
+static struct meta_set *meta_new(int fd) {
+    struct meta_set *ms = xmalloc(sizeof(*ms));
+    memset(ms, 0, sizeof(*ms));
+    ms->fd = fd;
+    ms->cap = (int)(META_CACHE_BYTES / geo.block_size);
+    if (ms->cap < META_MIN_BLOCKS) ms->cap = META_MIN_BLOCKS;
+    ms->e = xmalloc((size_t)ms->cap * sizeof(*ms->e));
+    ms->dirty_list = xmalloc((size_t)ms->cap * sizeof(int));
+    uint32_t nhash = 1;
+    while (nhash < 2 * (uint32_t)ms->cap) nhash <<= 1;
+    ms->hash = xmalloc(nhash * sizeof(int));
+    for (uint32_t h = 0; h < nhash; h++) ms->hash[h] = -1;
+    ms->hmask = nhash - 1;
+    ms->lru_head = ms->lru_tail = -1;
+    ms->zbuf = xmalloc_block();
+    ms->ov = overlay_new();
+    ms->isum.first_blk = geo.inode_bmap;
+    ms->isum.nbits = geo.inode_count;
+    ms->dsum.first_blk = geo.data_bmap;
+    ms->dsum.nbits = geo.data_nblocks;
+    return ms;
+}
+
+static void meta_free(struct meta_set *ms) {
+    for (int i = 0; i < ms->nblocks; i++) {
+        free(ms->e[i].buf);
+        free(ms->e[i].base);
+    }
+    free(ms->e);
+    free(ms->dirty_list);
+    free(ms->hash);
+    free(ms->zbuf);
+    overlay_free(ms->ov);
+    free(ms->isum.nfree);
+    free(ms->isum.full);
+    free(ms->dsum.nfree);
+    free(ms->dsum.full);
+    free(ms->dx.tab);
+    free(ms);
+}
+
+/* Drop every cached block (none may be dirty) and what was built from them: another
+ * process has committed since they were read, so they may be stale */
+static void meta_invalidate(struct meta_set *ms) {
+    for (int i = 0; i < ms->nblocks; i++) {
+        free(ms->e[i].buf);
+        free(ms->e[i].base);
+    }
+    ms->nblocks = 0;
+    for (uint32_t h = 0; h <= ms->hmask; h++) ms->hash[h] = -1;
+    ms->lru_head = ms->lru_tail = -1;
+    overlay_invalidate(ms->ov);
+    struct bitmap_sum *sums[2] = { &ms->isum, &ms->dsum };
+    for (int k = 0; k < 2; k++) {
+        free(sums[k]->nfree);
+        free(sums[k]->full);
+        sums[k]->nfree = NULL;
+        sums[k]->full = NULL;
+        sums[k]->built = 0;
+        sums[k]->hint = 0;
+    }
+    free(ms->dx.tab);
+    memset(&ms->dx, 0, sizeof(ms->dx));
+}
+
+static uint32_t meta_hash(const struct meta_set *ms, uint32_t blkno) {
+    return (blkno * 2654435761u) & ms->hmask;
+}
+
+static void meta_lru_unlink(struct meta_set *ms, int i) {
+    struct meta_ent *e = &ms->e[i];
+    if (e->prev >= 0) ms->e[e->prev].next = e->next;
+    else ms->lru_head = e->next;
+    if (e->next >= 0) ms->e[e->next].prev = e->prev;
+    else ms->lru_tail = e->prev;
+}
+
+static void meta_lru_push(struct meta_set *ms, int i) {
+    ms->e[i].prev = -1;
+    ms->e[i].next = ms->lru_head;
+    if (ms->lru_head >= 0) ms->e[ms->lru_head].prev = i;
+    else ms->lru_tail = i;
+    ms->lru_head = i;
+}
+
+/* Slot of a cached block without touching the LRU order, -1 if not cached */
+static int meta_lookup(const struct meta_set *ms, uint32_t blkno) {
+    for (int i = ms->hash[meta_hash(ms, blkno)]; i >= 0; i = ms->e[i].hnext)
+        if (ms->e[i].blkno == blkno) return i;
+    return -1;
+}
+
+static int meta_find(struct meta_set *ms, uint32_t blkno) {
+    int i = meta_lookup(ms, blkno);
+    if (i >= 0 && ms->lru_head != i) {
+        meta_lru_unlink(ms, i);
+        meta_lru_push(ms, i);
+    }
+    return i;
+}
+
+static void meta_unhash(struct meta_set *ms, int i) {
+    int *p = &ms->hash[meta_hash(ms, ms->e[i].blkno)];
+    while (*p != i) p = &ms->e[*p].hnext;
+    *p = ms->e[i].hnext;
+}
+
+/* Slot for a block not cached yet: a free one, else the least recently used clean one.
+ * If only journaled blocks are left, checkpoint first. Returns the slot, or a negative
+ * errno (also left in ms->err). */
+static int meta_slot(struct meta_set *ms, uint32_t blkno) {
+    int i = -1;
+    if (ms->nblocks < ms->cap) {
+        i = ms->nblocks++;
+        ms->e[i].buf = xmalloc_block();
+        ms->e[i].base = xmalloc_block();
+    } else {
+        for (;;) {
+            int waiting = 0;
+            uint64_t gen = __atomic_load_n(&ckpt_gen, __ATOMIC_ACQUIRE);
+            for (int k = ms->lru_tail; k >= 0; k = ms->e[k].prev) {
+                if (ms->e[k].dirty) continue;
+                if (ms->e[k].journaled > gen) {
+                    waiting = 1;
+                    continue;
+                }
+                i = k;
+                break;
+            }
+            if (i >= 0 || !waiting) break;
+            int rc = journal_checkpoint(ms->fd, NULL);
+            if (rc < 0) return ms->err = rc;
+        }
+        if (i < 0) return ms->err = jfail(ENOBUFS, "meta: all %d cached metadata blocks are dirty", ms->cap);
+        meta_unhash(ms, i);
+        meta_lru_unlink(ms, i);
+    }
+    struct meta_ent *e = &ms->e[i];
+    e->blkno = blkno;
+    e->dirty = 0;
+    e->has_base = 0;
+    e->enc = 0;
+    e->journaled = 0;
+    uint32_t h = meta_hash(ms, blkno);
+    e->hnext = ms->hash[h];
+    ms->hash[h] = i;
+    meta_lru_push(ms, i);
+    return i;
+}
+
+/* Drop a slot that holds nothing (its read failed); it is reused first */
+static void meta_forget(struct meta_set *ms, int i) {
+    meta_unhash(ms, i);
+    meta_lru_unlink(ms, i);
+    ms->e[i].blkno = 0;                      /* block 0 is never cached */
+    uint32_t h = meta_hash(ms, 0);
+    ms->e[i].hnext = ms->hash[h];
+    ms->hash[h] = i;
+    ms->e[i].prev = ms->lru_tail;
+    ms->e[i].next = -1;
+    if (ms->lru_tail >= 0) ms->e[ms->lru_tail].next = i;
+    else ms->lru_head = i;
+    ms->lru_tail = i;
+}
+
+/* A block not cached is read through the overlay: its latest committed contents, from
+ * the journal if it has not been installed yet, else from home. */
+static uint8_t *meta_get(struct meta_set *ms, uint32_t blkno) {
+    int i = meta_find(ms, blkno);
+    if (i >= 0) {
+        ms->hits++;
+        return ms->e[i].buf;
+    }
+    if ((i = meta_slot(ms, blkno)) < 0) return NULL;
+    ms->misses++;
+    struct meta_ent *e = &ms->e[i];
+    int rc = overlay_read(ms->ov, ms->fd, blkno, e->buf);
+    if (rc < 0) {
+        meta_forget(ms, i);
+        ms->err = rc;
+        return NULL;
+    }
+    memcpy(e->base, e->buf, geo.block_size);
+    e->has_base = 1;
+    return e->buf;
+}
+
+/* Cache a block whose old contents do not matter (newly allocated), zero-filled */
+static uint8_t *meta_get_zeroed(struct meta_set *ms, uint32_t blkno) {
+    int i = meta_find(ms, blkno);
+    if (i < 0 && (i = meta_slot(ms, blkno)) < 0) return NULL;
+    memset(ms->e[i].buf, 0, geo.block_size);
+    return ms->e[i].buf;
+}
+
+static void meta_mark_dirty(struct meta_set *ms, uint32_t blkno) {
+    int i = meta_find(ms, blkno);
+    if (i >= 0 && !ms->e[i].dirty) {
+        ms->e[i].dirty = 1;
+        ms->dirty_list[ms->ndirty++] = i;
+    }
+}
+
+/* Changed byte ranges of buf against base, at most DELTA_MAX_RANGES. Ranges closer
+ * than a DELTA prefix are merged. Returns the number of ranges, or -1 if a full DATA
+ * image is no bigger. */
+static int meta_diff(const uint8_t *base, const uint8_t *buf, uint32_t off[], uint32_t len[]) {
+    uint32_t bs = geo.block_size, bytes = 0;
+    int n = 0;
+    for (uint32_t i = 0; i < bs;) {
+        uint64_t a, b;
+        if (i + 8 <= bs && (memcpy(&a, base + i, 8), memcpy(&b, buf + i, 8), a == b)) {
+            i += 8;
+            continue;
+        }
+        if (base[i] == buf[i]) {
+            i++;
+            continue;
+        }
+        if (n > 0 && i - (off[n - 1] + len[n - 1]) <= sizeof(struct delta_rec_prefix)) {
+            bytes -= (uint32_t)DELTA_REC_SIZE(len[n - 1]);
+            n--;
+        } else if (n == DELTA_MAX_RANGES) {
+            return -1;
+        } else {
+            off[n] = i;
+        }
+        len[n] = i + 1 - off[n];
+        bytes += (uint32_t)DELTA_REC_SIZE(len[n]);
+        n++;
+        i++;
+    }
+    return bytes < DATA_REC_SIZE ? n : -1;
+}
+
+/* Bytes meta_commit's records for dirty block i take in the record format: its DELTA
+ * records, else its image as txn_build_records logs it (ZDATA when that is smaller) */
+static uint32_t meta_enc_bytes(struct meta_set *ms, const struct meta_ent *e) {
+    uint32_t off[DELTA_MAX_RANGES], len[DELTA_MAX_RANGES], bytes = 0;
+    int n = e->has_base && !full_images ? meta_diff(e->base, e->buf, off, len) : -1;
+    for (int r = 0; r < n; r++) bytes += (uint32_t)DELTA_REC_SIZE(len[r]);
+    if (n >= 0) return bytes;
+    if (full_images) return (uint32_t)DATA_REC_SIZE;
+    uint32_t zlen = rle_encode(e->buf, geo.block_size, ms->zbuf, (uint32_t)(DATA_REC_SIZE - ZDATA_REC_SIZE(1)));
+    return zlen ? (uint32_t)ZDATA_REC_SIZE(zlen) : (uint32_t)DATA_REC_SIZE;
+}
+
+/* Bytes the open group takes as one transaction in this journal, as meta_commit will
+ * log it; blocks[0..n) are the ones changed since the last call. txn_bytes is only an
+ * upper bound in the record format, where most blocks go out as a few DELTA records. */
+static uint32_t meta_txn_bytes(struct meta_set *ms, const struct journal_header *jh,
+                               const uint32_t *blocks, int n) {
+    if (journal_is_block_fmt(jh)) return txn_bytes(jh, ms->ndirty);
+    for (int k = 0; k < n; k++) {
+        int i = meta_lookup(ms, blocks[k]);
+        if (i < 0 || !ms->e[i].dirty) continue;
+        ms->enc_bytes -= ms->e[i].enc;
+        ms->e[i].enc = meta_enc_bytes(ms, &ms->e[i]);
+        ms->enc_bytes += ms->e[i].enc;
+    }
+    return ms->enc_bytes + (uint32_t)COMMIT_REC_SIZE;
+}
+
+/* Log every dirty block once, seal with one COMMIT. In the record format a block whose
+ * previous contents are known is logged as DELTA records against them (unless
+ * full_images), otherwise as a full image. Buffers stay cached (they are now newer than
+ * home) and become the next delta base. Returns the number of records written; on error the blocks stay dirty. */
+static int meta_commit(struct meta_set *ms, struct journal_header *jh) {
+    if (ms->ndirty == 0) return 0;
+
+    int deltas = !journal_is_block_fmt(jh) && !full_images;
+    struct txn t;
+    int rc = 0;
+    txn_begin(&t);
+    for (int d = 0; d < ms->ndirty && rc == 0; d++) {
+        struct meta_ent *e = &ms->e[ms->dirty_list[d]];
+        uint32_t off[DELTA_MAX_RANGES], len[DELTA_MAX_RANGES];
+        int n = deltas && e->has_base ? meta_diff(e->base, e->buf, off, len) : -1;
+        if (n < 0) rc = txn_log_block(&t, e->blkno, e->buf);
+        for (int r = 0; r < n && rc == 0; r++)
+            rc = txn_log_delta(&t, e->blkno, e->buf + off[r], off[r], len[r]);
+    }
+    if (rc == 0 && t.nrecs > 0) rc = txn_commit(ms->fd, jh, &t);
+    if (rc < 0) return rc;
+
+    uint64_t journaled = __atomic_load_n(&ckpt_started, __ATOMIC_ACQUIRE) + 1;
+    for (int d = 0; d < ms->ndirty; d++) {
+        struct meta_ent *e = &ms->e[ms->dirty_list[d]];
+        memcpy(e->base, e->buf, geo.block_size);
+        e->has_base = 1;
+        e->journaled = journaled;
+        e->dirty = 0;
+        e->enc = 0;
+    }
+    ms->ndirty = 0;
+    ms->enc_bytes = 0;
+    return t.nrecs;
+}
+
+static int bitmap_test(const uint8_t *bmap, uint32_t i) {
+    return (bmap[i / 8] >> (i % 8)) & 1;
+}
+
+static void bitmap_set(uint8_t *bmap, uint32_t i) {
+    bmap[i / 8] |= (uint8_t)(1u << (i % 8));
+}
+
+/* First clear bit of bmap[0..n) at or after from, n if there is none */
+static uint32_t bitmap_ffz(const uint8_t *bmap, uint32_t from, uint32_t n) {
+    for (; from < n && from % 8 != 0; from++)
+        if (!bitmap_test(bmap, from)) return from;
+    if (from >= n) return n;
+    uint32_t nbytes = (n + 7) / 8;
+    uint32_t b = from / 8 + ffz_bytes(bmap + from / 8, nbytes - from / 8);
+    if (b == nbytes) return n;
+    uint32_t bit = b * 8 + (uint32_t)__builtin_ctz(~(unsigned)bmap[b]);
+    return bit < n ? bit : n;             /* padding bits past n may be clear */
+}
+
+/* ----- free-space summary -----
+ * A linear bitmap walk per allocation grows with the image, so each bitmap has a
+ * two-level summary in memory: free bits per bitmap block, and a mask with one bit per
+ * 64-bit bitmap word that is set once the word is full. A search skips full blocks
+ * without reading them and full words by scanning the mask (64 times smaller, with
+ * bitmap_ffz), so its cost does not depend on how much of the bitmap is in use. The
+ * summary is built from the cached bitmap blocks on the first allocation and updated
+ * for every allocation of a create that stays in its group (bitmap_sum_take); VSFS
+ * never frees, so the next-free hint only moves forward.
+ */
+
+/* 64-bit word w of a bitmap block, bits past nbits (of word base bit) read as set */
+static uint64_t bitmap_word(const uint8_t *bmap, uint32_t w, uint32_t base, uint32_t nbits) {
+    uint64_t x;
+    memcpy(&x, bmap + (size_t)w * 8, 8);
+    if (nbits - base < 64) x |= ~0ull << (nbits - base);
+    return x;
+}
+
+static int bitmap_sum_build(struct meta_set *ms, struct bitmap_sum *sum) {
+    uint32_t bits_per_blk = geo.block_size * 8, words_per_blk = geo.block_size / 8;
+    uint32_t nwords = (sum->nbits + 63) / 64;
+    sum->nblks = (sum->nbits + bits_per_blk - 1) / bits_per_blk;
+    sum->nfree = xmalloc((size_t)sum->nblks * sizeof(*sum->nfree));
+    sum->full = xmalloc((nwords + 7) / 8);
+    memset(sum->full, 0, (nwords + 7) / 8);
+    for (uint32_t b = 0; b < sum->nblks; b++) {
+        const uint8_t *bmap = meta_get(ms, sum->first_blk + b);
+        if (!bmap) {
+            free(sum->nfree);
+            free(sum->full);
+            sum->nfree = NULL;
+            sum->full = NULL;
+            return ms->err;
+        }
+        sum->nfree[b] = 0;
+        for (uint32_t i = 0; i < words_per_blk && b * words_per_blk + i < nwords; i++) {
+            uint32_t w = b * words_per_blk + i;
+            uint64_t x = bitmap_word(bmap, i, w * 64, sum->nbits);
+            sum->nfree[b] += 64 - (uint32_t)__builtin_popcountll(x);
+            if (x == ~0ull) bitmap_set(sum->full, w);
+        }
+    }
+    sum->built = 1;
+    return 0;
+}
+
+/* First clear bit of the bitmap sum describes, into *bit. Returns 0, -ENOSPC if all
+ * are set, or the error of a failed read. */
+static int bitmap_find_zero(struct meta_set *ms, struct bitmap_sum *sum, uint32_t *bit) {
+    int rc;
+    if (!sum->built && (rc = bitmap_sum_build(ms, sum)) < 0) return rc;
+    uint32_t bits_per_blk = geo.block_size * 8, words_per_blk = geo.block_size / 8;
+    uint32_t nwords = (sum->nbits + 63) / 64;
+    for (uint32_t b = sum->hint / bits_per_blk; b < sum->nblks; b++) {
+        if (sum->nfree[b] == 0) continue;
+        uint32_t w0 = b * words_per_blk;
+        uint32_t w1 = w0 + words_per_blk < nwords ? w0 + words_per_blk : nwords;
+        uint32_t w = bitmap_ffz(sum->full, sum->hint / 64 > w0 ? sum->hint / 64 : w0, w1);
+        if (w == w1) continue;
+        const uint8_t *bmap = meta_get(ms, sum->first_blk + b);
+        if (!bmap) return ms->err;
+        uint64_t x = bitmap_word(bmap, w - w0, w * 64, sum->nbits);
+        *bit = sum->hint = w * 64 + (uint32_t)__builtin_ctzll(~x);
+        return 0;
+    }
+    sum->hint = sum->nbits;
+    return -ENOSPC;
+}
+
+/* Set bit (found by bitmap_find_zero) in the cached bitmap */
+static void bitmap_alloc(struct meta_set *ms, struct bitmap_sum *sum, uint32_t bit) {
+    uint32_t bits_per_blk = geo.block_size * 8;
+    uint32_t blk = sum->first_blk + bit / bits_per_blk;
+    bitmap_set(meta_get(ms, blk), bit % bits_per_blk);     /* cached by the caller */
+    meta_mark_dirty(ms, blk);
+}
+
+/* Count a bit bitmap_alloc set in the summary, once its create stays in the group */
+static void bitmap_sum_take(struct meta_set *ms, struct bitmap_sum *sum, uint32_t bit) {
+    uint32_t bits_per_blk = geo.block_size * 8;
+    const uint8_t *bmap = meta_get(ms, sum->first_blk + bit / bits_per_blk);
+    sum->nfree[bit / bits_per_blk]--;
+    if (bitmap_word(bmap, bit % bits_per_blk / 64, bit - bit % 64, sum->nbits) == ~0ull)
+        bitmap_set(sum->full, bit / 64);
+}
+
+static struct inode *root_inode(struct meta_set *ms) {
+    uint8_t *blk = meta_get(ms, geo.inode_tbl);
+    return blk ? (struct inode *)blk + ROOT_INO : NULL;
+}
+
+/* ----- root directory index -----
+ * Checking for a duplicate name used to compare every entry of the root directory on
+ * every create. The index maps the hash of each name (crc32c) to its dirent, so a new
+ * name costs one probe sequence and usually no directory block at all; a hash match is
+ * confirmed against the cached dirent. Free entries come from a cursor: VSFS never
+ * removes, so everything below the first free dirent stays in use. The index is built
+ * by one pass over the directory on a handle's first create and updated for every
+ * create that stays in its group (vsfs_create_index); it lives in memory only, so the
+ * on-disk format is unchanged.
+ */
+
+static uint32_t dir_name_hash(const char *name) {
+    return crc32c(0, name, strnlen(name, NAME_LEN));
+}
+
+static void dir_index_put(struct dir_index *dx, uint32_t hash, uint32_t slot, uint32_t blkno) {
+    if (2 * (dx->n + 1) > dx->mask + 1) {       /* keep the load at most 1/2 */
+        uint32_t size = dx->tab ? 2 * (dx->mask + 1) : 64;
+        struct dir_ent *old = dx->tab;
+        uint32_t old_size = dx->tab ? dx->mask + 1 : 0;
+        dx->tab = xmalloc((size_t)size * sizeof(*dx->tab));
+        memset(dx->tab, 0, (size_t)size * sizeof(*dx->tab));
+        dx->mask = size - 1;
+        dx->n = 0;
+        for (uint32_t i = 0; i < old_size; i++)
+            if (old[i].slot) dir_index_put(dx, old[i].hash, old[i].slot - 1, old[i].blkno);
+        free(old);
+    }
+    uint32_t i = hash & dx->mask;
+    while (dx->tab[i].slot) i = (i + 1) & dx->mask;
+    dx->tab[i] = (struct dir_ent){ hash, slot + 1, blkno };
+    dx->n++;
+}
+
+/* Index the root directory: every name, and where the first free dirent is */
+static int dir_index_build(struct meta_set *ms, struct dir_index *dx) {
+    struct inode *root = root_inode(ms);
+    if (!root) return ms->err;
+    if (root->type != INODE_TYPE_DIR) return -EIO;
+    uint32_t direct[DIRECT_POINTERS];          /* reading the blocks may evict root's */
+    memcpy(direct, root->direct, sizeof(direct));
+
+    int have_free = 0;
+    uint32_t d;
+    for (d = 0; d < DIRECT_POINTERS && direct[d] != 0; d++) {
+        if (direct[d] < geo.data_start || direct[d] >= geo.total_blocks) return -EIO;
+        const struct dirent *de = (const struct dirent *)meta_get(ms, direct[d]);
+        if (!de) return ms->err;
+        for (uint32_t i = 0; i < geo.dirents_per_block; i++) {
+            uint32_t slot = d * geo.dirents_per_block + i;
+            if (de[i].name[0] != '\0') {
+                dir_index_put(dx, dir_name_hash(de[i].name), slot, direct[d]);
+            } else if (!have_free) {
+                have_free = 1;
+                dx->next_free = slot;
+            }
+        }
+    }
+    if (!have_free) dx->next_free = d * geo.dirents_per_block;
+    dx->built = 1;
+    return 0;
+}
+
+/* 1 if the root directory has an entry called name (hash: its dir_name_hash), 0 if
+ * not, or the error of a failed read */
+static int dir_index_has(struct meta_set *ms, const struct dir_index *dx, const char *name, uint32_t hash) {
+    if (!dx->tab) return 0;
+    for (uint32_t i = hash & dx->mask; dx->tab[i].slot; i = (i + 1) & dx->mask) {
+        if (dx->tab[i].hash != hash) continue;
+        const struct dirent *de = (const struct dirent *)meta_get(ms, dx->tab[i].blkno);
+        if (!de) return ms->err;
+        if (strncmp(de[(dx->tab[i].slot - 1) % geo.dirents_per_block].name, name, NAME_LEN) == 0) return 1;
+    }
+    return 0;
+}
+
+/* What one create will do; every home block it dirties is in blocks[] */
+struct create_plan {
+    uint32_t ino;
+    uint32_t dir_idx;          /* root->direct[] index that receives the entry */
+    uint32_t dir_blk;
+    uint32_t slot;             /* dirent index inside dir_blk */
+    int      dir_grow;         /* dir_blk is allocated by this create */
+    uint32_t data_bit;         /* data bitmap bit of dir_blk when dir_grow */
+    uint32_t name_hash;
+    uint32_t blocks[CREATE_MAX_BLOCKS];
+    int      nblocks;
+};
+
+static void plan_add(struct create_plan *pl, uint32_t blkno) {
+    for (int i = 0; i < pl->nblocks; i++)
+        if (pl->blocks[i] == blkno) return;
+    pl->blocks[pl->nblocks++] = blkno;
+}
+
+/* Decide inode, directory slot and touched blocks for "create filename" without
+ * changing anything. Returns 0, or -EINVAL / -ENAMETOOLONG / -EEXIST / -ENOSPC / -EIO
+ * without a message (the caller names the file), or the error of a failed read. */
+static int vsfs_create_plan(struct meta_set *ms, const char *filename, struct create_plan *pl) {
+    size_t name_len = strlen(filename);
+    if (name_len > JOURNAL_NAME_MAX) return -ENAMETOOLONG;
+    if (name_len == 0 || strchr(filename, '/') != NULL) return -EINVAL;
+
+    memset(pl, 0, sizeof(*pl));
+    int rc;
+    /* building the summaries and the directory index reads whole bitmaps and the
+     * directory, which may evict blocks: do it before holding any pointer into the cache */
+    if ((!ms->isum.built && (rc = bitmap_sum_build(ms, &ms->isum)) < 0) ||
+        (!ms->dsum.built && (rc = bitmap_sum_build(ms, &ms->dsum)) < 0) ||
+        (!ms->dx.built && (rc = dir_index_build(ms, &ms->dx)) < 0))
+        return rc;
+
+    /* 1) reject duplicates, then take the first free dirent */
+    pl->name_hash = dir_name_hash(filename);
+    if ((rc = dir_index_has(ms, &ms->dx, filename, pl->name_hash)) != 0) return rc < 0 ? rc : -EEXIST;
+    struct inode *root = root_inode(ms);
+    if (!root) return ms->err;
+    if (root->type != INODE_TYPE_DIR) return -EIO;
+    plan_add(pl, geo.inode_tbl);
+
+    int have_slot = 0;
+    uint32_t d = 0;
+    for (uint32_t slot = ms->dx.next_free;; slot++) {
+        d = slot / geo.dirents_per_block;
+        if (d >= DIRECT_POINTERS || root->direct[d] == 0) break;
+        uint32_t blk = root->direct[d];
+        if (blk < geo.data_start || blk >= geo.total_blocks) return -EIO;
+        const struct dirent *de = (const struct dirent *)meta_get(ms, blk);
+        if (!de) return ms->err;
+        if (de[slot % geo.dirents_per_block].name[0] == '\0') {
+            have_slot = 1;
+            pl->dir_idx = d;
+            pl->dir_blk = blk;
+            pl->slot = slot % geo.dirents_per_block;
+            break;
+        }
+        ms->dx.next_free = slot + 1;
+    }
+
+    if (!have_slot) {
+        /* grow the root directory by one data block */
+        if (d >= DIRECT_POINTERS) return -ENOSPC;
+        if ((rc = bitmap_find_zero(ms, &ms->dsum, &pl->data_bit)) < 0) return rc;
+        pl->dir_grow = 1;
+        pl->dir_idx = d;
+        pl->dir_blk = geo.data_start + pl->data_bit;
+        pl->slot = 0;
+        plan_add(pl, geo.data_bmap + pl->data_bit / (geo.block_size * 8));
+    }
+    plan_add(pl, pl->dir_blk);
+
+    /* 2) pick an inode */
+    if ((rc = bitmap_find_zero(ms, &ms->isum, &pl->ino)) < 0) return rc;
+    plan_add(pl, geo.inode_bmap + pl->ino / (geo.block_size * 8));
+    plan_add(pl, geo.inode_tbl + pl->ino / geo.inodes_per_block);
+    return 0;
+}
+
+/* Cache every block of a plan, so that applying it cannot fail halfway and
+ * create_undo_save can copy them first */
+static int vsfs_create_fetch(struct meta_set *ms, const struct create_plan *pl) {
+    for (int i = 0; i < pl->nblocks; i++)
+        if (!(pl->dir_grow && pl->blocks[i] == pl->dir_blk) && !meta_get(ms, pl->blocks[i])) return ms->err;
+    if (pl->dir_grow && !meta_get_zeroed(ms, pl->dir_blk)) return ms->err;
+    return 0;
+}
+
+/* Apply a plan from vsfs_create_plan() to the blocks vsfs_create_fetch cached */
+static void vsfs_create_apply(struct meta_set *ms, const char *filename, const struct create_plan *pl) {
+    uint32_t now = (uint32_t)time(NULL);
+
+    /* 1) allocate the inode */
+    bitmap_alloc(ms, &ms->isum, pl->ino);
+
+    /* 2) initialize the inode; it may share the root inode's table block */
+    uint32_t tbl_home = geo.inode_tbl + pl->ino / geo.inodes_per_block;
+    struct inode *ip = (struct inode *)meta_get(ms, tbl_home) + pl->ino % geo.inodes_per_block;
+    memset(ip, 0, sizeof(*ip));
+    ip->type = INODE_TYPE_FILE;
+    ip->links = 1;
+    ip->ctime = now;
+    ip->mtime = now;
+    meta_mark_dirty(ms, tbl_home);
+
+    /* 3) link it into the root directory, growing it if planned */
+    struct inode *root = root_inode(ms);
+    struct dirent *de;
+    if (pl->dir_grow) {
+        bitmap_alloc(ms, &ms->dsum, pl->data_bit);
+        de = (struct dirent *)meta_get_zeroed(ms, pl->dir_blk);
+        root->direct[pl->dir_idx] = pl->dir_blk;
+    } else {
+        de = (struct dirent *)meta_get(ms, pl->dir_blk);
+    }
+    memset(&de[pl->slot], 0, sizeof(de[pl->slot]));
+    de[pl->slot].inode = pl->ino;
+    memcpy(de[pl->slot].name, filename, strlen(filename));
+    meta_mark_dirty(ms, pl->dir_blk);
+
+    uint32_t end = (pl->dir_idx * geo.dirents_per_block + pl->slot + 1) * (uint32_t)sizeof(struct dirent);
+    if (root->size < end) root->size = end;
+    root->mtime = now;
+    meta_mark_dirty(ms, geo.inode_tbl);
+}
+
+/* Record an applied create in the bitmap summaries and the directory index */
+static void vsfs_create_index(struct meta_set *ms, const struct create_plan *pl) {
+    bitmap_sum_take(ms, &ms->isum, pl->ino);
+    if (pl->dir_grow) bitmap_sum_take(ms, &ms->dsum, pl->data_bit);
+    uint32_t slot = pl->dir_idx * geo.dirents_per_block + pl->slot;
+    dir_index_put(&ms->dx, pl->name_hash, slot, pl->dir_blk);
+    ms->dx.next_free = slot + 1;
+}
+
+/* A plan's blocks as they were before vsfs_create_apply, to take the create back out
+ * of the group. Nothing is evicted in between: the blocks were fetched first. */
+struct create_undo {
+    int ndirty;
+    uint32_t enc_bytes;
+    int slot[CREATE_MAX_BLOCKS];
+    uint8_t dirty[CREATE_MAX_BLOCKS];
+    uint32_t enc[CREATE_MAX_BLOCKS];
+    uint8_t *buf;              /* CREATE_MAX_BLOCKS blocks */
+};
+
+static void create_undo_save(struct meta_set *ms, const struct create_plan *pl, struct create_undo *u) {
+    u->ndirty = ms->ndirty;
+    u->enc_bytes = ms->enc_bytes;
+    for (int i = 0; i < pl->nblocks; i++) {
+        const struct meta_ent *e = &ms->e[u->slot[i] = meta_lookup(ms, pl->blocks[i])];
+        u->dirty[i] = e->dirty;
+        u->enc[i] = e->enc;
+        memcpy(u->buf + (size_t)i * geo.block_size, e->buf, geo.block_size);
+    }
+    for (int i = pl->nblocks; i < CREATE_MAX_BLOCKS; i++) u->slot[i] = -1;
+}
+
+static void create_undo_restore(struct meta_set *ms, const struct create_undo *u) {
+    for (int i = 0; i < CREATE_MAX_BLOCKS && u->slot[i] >= 0; i++) {
+        struct meta_ent *e = &ms->e[u->slot[i]];
+        e->dirty = u->dirty[i];
+        e->enc = u->enc[i];
+        memcpy(e->buf, u->buf + (size_t)i * geo.block_size, geo.block_size);
+    }
+    ms->ndirty = u->ndirty;            /* dirty_list only grew past it */
+    ms->enc_bytes = u->enc_bytes;
+}
+
+/* Group commit: creates applied to one meta_set are sealed by one COMMIT. A group is
+ * closed early only when, with the next create applied and encoded the way meta_commit
+ * will log it, it would not fit into the journal below the high-water mark; the create
+ * is then taken back out (create_undo), the group committed without it, and the create
+ * planned again. Every journal handle has one (journal_create).
+ * On a shared handle a group holds the flock from its first plan to its commit, so no
+ * other process commits between what it read and what it logs. When the group starts,
+ * a next_seq other than the one this handle left means another process committed
+ * meanwhile, and the cache is dropped (meta_invalidate). */
+struct batch {
+    int fd;
+    struct journal_header jh;
+    struct meta_set *ms;
+    struct create_undo undo;
+    int locked;                /* group holds the flock (shared handles) */
+    uint32_t seen_seq;         /* next_seq when the flock was last released */
+    unsigned created, failed, groups, records, ckpts;
+};
+
+static int batch_open(struct batch *b, int fd) {
+    memset(b, 0, sizeof(*b));
+    b->fd = fd;
+    int rc = journal_read_header(fd, &b->jh);
+    if (rc < 0) return rc;
+    b->seen_seq = b->jh.next_seq;
+    b->ms = meta_new(fd);
+    b->undo.buf = xmalloc((size_t)CREATE_MAX_BLOCKS * geo.block_size);
+    return 0;
+}
+
+static int batch_lock(struct batch *b) {
+    if (journal_owned || b->locked) return 0;
+    int rc = journal_flock(b->fd);
+    if (rc < 0) return rc;
+    if ((rc = journal_read_header(b->fd, &b->jh)) < 0) {
+        journal_funlock(b->fd);
+        return rc;
+    }
+    if (b->jh.next_seq != b->seen_seq) meta_invalidate(b->ms);
+    b->locked = 1;
+    return 0;
+}
+
+/* Release the flock once the group is committed (dirty blocks keep it) */
+static void batch_unlock(struct batch *b) {
+    if (!b->locked || b->ms->ndirty > 0) return;
+    struct journal_header jh;
+    if (journal_read_header(b->fd, &jh) == 0) b->seen_seq = jh.next_seq;
+    else b->seen_seq = b->jh.next_seq - 1;     /* unknown: drop the cache next time */
+    journal_funlock(b->fd);
+    b->locked = 0;
+}
+
+/* Commit the open group, if any. Returns 1 if a transaction was written. */
+static int batch_flush(struct batch *b) {
+    int n = b->ms->ndirty > 0 ? meta_commit(b->ms, &b->jh) : 0;
+    batch_unlock(b);
+    if (n <= 0) return n;
+    b->records += (unsigned)n;
+    b->groups++;
+    return 1;
+}
+
+/* Add one create to the open group. Returns 0 (*ino set) or a negative errno. */
+static int batch_create(struct batch *b, const char *name, uint32_t *ino) {
+    struct create_plan pl;
+    int rc, applied = 0, ckpt = 0;
+    for (;;) {
+        if ((rc = batch_lock(b)) < 0 || (rc = vsfs_create_plan(b->ms, name, &pl)) < 0 ||
+            (rc = vsfs_create_fetch(b->ms, &pl)) < 0)
+            break;
+        create_undo_save(b->ms, &pl, &b->undo);
+        vsfs_create_apply(b->ms, name, &pl);
+        applied = 1;
+
+        /* if the group does not fit with this create in it, commit the group without it
+         * and plan again (on a shared handle the flock was let go in between) */
+        uint32_t len = meta_txn_bytes(b->ms, &b->jh, pl.blocks, pl.nblocks);
+        if (ckpt || (b->ms->ndirty <= TXN_MAX_BLOCKS && !journal_wants_checkpoint(&b->jh, len))) break;
+        create_undo_restore(b->ms, &b->undo);
+        applied = 0;
+        if (b->undo.ndirty > 0) {
+            if ((rc = batch_flush(b)) < 0) break;
+            continue;
+        }
+        /* alone it needs a checkpoint first; the cached blocks stay valid through it */
+        if ((rc = journal_make_room(b->fd, &b->jh, len)) < 0) break;
+        b->ckpts += (unsigned)rc;
+        ckpt = 1;
+    }
+
+    if (rc < 0) {
+        if (applied) create_undo_restore(b->ms, &b->undo);
+        b->failed++;
+        batch_unlock(b);
+        return rc;
+    }
+    vsfs_create_index(b->ms, &pl);
+    b->created++;
+    *ino = pl.ino;
+    return 0;
+}
+
+static int batch_close(struct batch *b) {
+    int rc = batch_flush(b);
+    meta_free(b->ms);
+    free(b->undo.buf);
+    b->ms = NULL;
+    return rc < 0 ? rc : 0;
+}
+
+/* =========================
+ *          INSTALL
+ * =========================
+ * Install scans the live log, replays every transaction that has a COMMIT by writing
+ * its logged images to their home blocks, and then checkpoints: head moves past them,
+ * so the journal is empty again if nothing was appended meanwhile.
+ *
+ * Replay is last-writer-wins: the scan only indexes home block_no -> journal offset of
+ * its image (or delta bytes); once a COMMIT is seen the transaction's entries join the
+ * committed index. The index is then sorted by block_no (ties keep scan order); each
+ * home block is written once, in one ascending sweep: its latest full (DATA or ZDATA)
+ * image with the DELTA records logged after it applied on top (the home image if
+ * there is none).
+ */
+
+struct replay_ent {
+    uint32_t block_no;
+    uint32_t img_off;      /* offset of the block image / delta bytes within the journal */
+    uint32_t order;        /* scan order, so the latest committed image wins */
+    uint16_t type;         /* REC_DATA, REC_ZDATA or REC_DELTA */
+    uint16_t offset;       /* DELTA: range within the block */
+    uint16_t length;       /* DELTA: range length; ZDATA: compressed length */
+};
+
+struct replay_index {
+    struct replay_ent *ents;
+    uint32_t n, cap;
+};
+
+/* Where a scan stopped: just past its last committed transaction */
+struct scan_end {
+    uint32_t off;
+    uint32_t bytes;        /* live bytes from head to off */
+};
+
+static void replay_push_rec(struct replay_index *ix, uint16_t type, uint32_t block_no,
+                            uint32_t img_off, uint16_t offset, uint16_t length) {
+    if (ix->n == ix->cap) {
+        ix->cap = ix->cap ? ix->cap * 2 : 64;
+        ix->ents = realloc(ix->ents, ix->cap * sizeof(*ix->ents));
+        if (!ix->ents) oom();
+    }
+    ix->ents[ix->n].block_no = block_no;
+    ix->ents[ix->n].img_off = img_off;
+    ix->ents[ix->n].order = ix->n;
+    ix->ents[ix->n].type = type;
+    ix->ents[ix->n].offset = offset;
+    ix->ents[ix->n].length = length;
+    ix->n++;
+}
+
+static void replay_push(struct replay_index *ix, uint32_t block_no, uint32_t img_off) {
+    replay_push_rec(ix, REC_DATA, block_no, img_off, 0, 0);
+}
+
+static int replay_ent_cmp(const void *a, const void *b) {
+    const struct replay_ent *x = a, *y = b;
+    if (x->block_no != y->block_no) return x->block_no < y->block_no ? -1 : 1;
+    return x->order < y->order ? -1 : (x->order > y->order);
+}
+
+/* Sort by block_no and keep, per block, only the last committed full image and the
+ * deltas after it. */
+static void replay_dedup(struct replay_index *ix) {
+    if (ix->n > 1) qsort(ix->ents, ix->n, sizeof(*ix->ents), replay_ent_cmp);
+    uint32_t out = 0, first = 0;   /* first: start of the current block's run in out */
+    for (uint32_t i = 0; i < ix->n; i++) {
+        if (out == 0 || ix->ents[out - 1].block_no != ix->ents[i].block_no) first = out;
+        else if (ix->ents[i].type != REC_DELTA) out = first;   /* later image replaces the run */
+        ix->ents[out++] = ix->ents[i];
+    }
+    ix->n = out;
+}
+
+/* Scan the live log [head, tail) and fill ix with committed DATA/ZDATA/DELTA records.
+ * A bad record or an out-of-sequence COMMIT ends the scan like a torn tail: its
+ * transaction is not committed. The scan also stops after the first transaction that
+ * leaves at most keep live bytes behind it. Returns the number of committed
+ * transactions (end: where the last one ends), or a negative errno if the journal
+ * cannot be read. */
+static int journal_scan_records(int fd, const struct journal_header *jh, struct replay_index *ix,
+                                uint32_t keep, struct scan_end *end) {
+    uint32_t log_start = journal_log_start(jh);
+    uint32_t off = jh->head;
+    uint32_t total = jh->nbytes_used - log_start;
+    uint32_t left = total;                         /* live bytes not scanned yet */
+    uint32_t committed = 0;
+    uint32_t committed_n = ix->n;   /* entries up to here belong to committed transactions */
+    int rc = 0;
+    uint32_t seq = jh->head_seq;
+    uint32_t crc = crc32c(0, &seq, sizeof(seq));
+    uint8_t *rec = xmalloc(DATA_REC_SIZE);
+    uint8_t *img = xmalloc(geo.block_size);       /* ZDATA images are test-decoded */
+    end->off = off;
+    end->bytes = 0;
+
+    while (left > 0) {
+        struct rec_header rh;
+        if (geo.journal_bytes - off < sizeof(rh)) {        /* tail end too short for a record */
+            left -= (geo.journal_bytes - off < left) ? geo.journal_bytes - off : left;
+            off = log_start;
+            continue;
+        }
+        if ((rc = journal_read_bytes(fd, off, &rh, sizeof(rh))) < 0) break;
+        if (rh.type == REC_PAD) {
+            if (geo.journal_bytes - off > left) break;
+            left -= geo.journal_bytes - off;
+            off = log_start;
+            continue;
+        }
+        if (rh.size < sizeof(rh) || rh.size > left) break;
+
+        if (rh.type == REC_DATA && rh.size == DATA_REC_SIZE) {
+            uint32_t block_no;
+            if ((rc = journal_read_bytes(fd, off, rec, rh.size)) < 0) break;
+            memcpy(&block_no, rec + sizeof(rh), sizeof(block_no));
+            if (block_no < geo.inode_bmap || block_no >= geo.total_blocks) break;  /* never superblock/journal */
+            crc = crc32c(crc, rec, rh.size);
+            replay_push(ix, block_no, off + (uint32_t)(sizeof(rh) + sizeof(block_no)));
+        } else if (rh.type == REC_DELTA && rh.size > sizeof(struct delta_rec_prefix) &&
+                   rh.size < DATA_REC_SIZE) {
+            struct delta_rec_prefix dp;
+            if ((rc = journal_read_bytes(fd, off, rec, rh.size)) < 0) break;
+            memcpy(&dp, rec, sizeof(dp));
+            if (dp.block_no < geo.inode_bmap || dp.block_no >= geo.total_blocks ||
+                rh.size != DELTA_REC_SIZE(dp.length) || dp.offset + dp.length > geo.block_size)
+                break;
+            crc = crc32c(crc, rec, rh.size);
+            replay_push_rec(ix, REC_DELTA, dp.block_no, off + (uint32_t)sizeof(dp), dp.offset, dp.length);
+        } else if (rh.type == REC_ZDATA && rh.size > sizeof(struct zdata_rec_prefix) &&
+                   rh.size < DATA_REC_SIZE) {
+            struct zdata_rec_prefix zp;
+            if ((rc = journal_read_bytes(fd, off, rec, rh.size)) < 0) break;
+            memcpy(&zp, rec, sizeof(zp));
+            if (zp.block_no < geo.inode_bmap || zp.block_no >= geo.total_blocks ||
+                rh.size != ZDATA_REC_SIZE(zp.zlen) || zp.codec != ZCODEC_RLE ||
+                rle_decode(rec + sizeof(zp), zp.zlen, img, geo.block_size) < 0)
+                break;
+            crc = crc32c(crc, rec, rh.size);
+            replay_push_rec(ix, REC_ZDATA, zp.block_no, off + (uint32_t)sizeof(zp), 0, zp.zlen);
+        } else if (rh.type == REC_COMMIT && rh.size == COMMIT_REC_SIZE) {
+            struct commit_record cr;
+            if ((rc = journal_read_bytes(fd, off, &cr, sizeof(cr))) < 0) break;
+            if (cr.seq != seq || cr.csum != crc) break;     /* torn or out of sequence */
+            committed++;
+            committed_n = ix->n;
+            seq++;
+            crc = crc32c(0, &seq, sizeof(seq));
+            end->off = off + rh.size;
+            end->bytes = total - (left - rh.size);
+            if (left - rh.size <= keep) break;
+        } else {
+            break;
+        }
+        off += rh.size;
+        left -= rh.size;
+    }
+
+    /* discard DATA records of a transaction without (valid) COMMIT */
+    free(rec);
+    free(img);
+    ix->n = committed_n;
+    return rc < 0 ? rc : (int)committed;
+}
+
+/* Same for the block format: a transaction counts only if its COMMIT block follows the
+ * descriptor's images, carries the descriptor's sequence number and matches the
+ * checksum of DESC + images. */
+static int journal_scan_blocks(int fd, const struct journal_header *jh, struct replay_index *ix,
+                               uint32_t keep, struct scan_end *end) {
+    uint32_t bs = geo.block_size;
+    uint32_t off = jh->head;
+    uint32_t total = jh->nbytes_used - bs;
+    uint32_t left = total;
+    uint32_t committed = 0;
+    int rc = 0;
+    uint8_t *blk = xmalloc_block();        /* DESC block */
+    uint8_t *img = xmalloc_block();        /* images, then COMMIT block */
+    const struct jblock_header *bh = (const struct jblock_header *)blk;
+    end->off = off;
+    end->bytes = 0;
+
+    while (left > 0) {
+        if (off == geo.journal_bytes) {
+            off = bs;
+            continue;
+        }
+        if ((rc = journal_read_bytes(fd, off, blk, bs)) < 0) break;
+        if (bh->magic != JOURNAL_MAGIC) break;
+        if (bh->type == REC_PAD) {
+            if (geo.journal_bytes - off > left) break;
+            left -= geo.journal_bytes - off;
+            off = bs;
+            continue;
+        }
+        if (bh->type != REC_DESC || bh->seq != jh->head_seq + committed ||
+            bh->count == 0 || bh->count > DESC_MAX_BLOCKS)
+            break;
+        uint32_t size = (bh->count + 2) * bs;
+        if (size > left || (uint64_t)off + size > geo.journal_bytes) break;
+
+        uint32_t first = ix->n, seq = bh->seq, count = bh->count;
+        uint32_t crc = crc32c(crc32c(0, &seq, sizeof(seq)), blk, bs);
+        const uint32_t *block_no = (const uint32_t *)(bh + 1);
+        int bad = 0;
+        for (uint32_t i = 0; i < count && !bad; i++) {
+            if (block_no[i] < geo.inode_bmap || block_no[i] >= geo.total_blocks) bad = 1;
+            else replay_push(ix, block_no[i], off + (i + 1) * bs);
+        }
+        for (uint32_t i = 0; i < count && !bad; i++) {
+            if ((rc = journal_read_bytes(fd, off + (i + 1) * bs, img, bs)) < 0) bad = 1;
+            else crc = crc32c(crc, img, bs);
+        }
+        if (!bad) {
+            const struct jblock_header *cb = (const struct jblock_header *)img;
+            if ((rc = journal_read_bytes(fd, off + (count + 1) * bs, img, bs)) < 0) bad = 1;
+            else bad = cb->magic != JOURNAL_MAGIC || cb->type != REC_COMMIT || cb->seq != seq || cb->csum != crc;
+        }
+        if (bad) {
+            ix->n = first;
+            break;
+        }
+        committed++;
+        off += size;
+        left -= size;
+        end->off = off;
+        end->bytes = total - left;
+        if (left <= keep) break;
+    }
+    free(blk);
+    free(img);
+    return rc < 0 ? rc : (int)committed;
+}
+
+static int journal_scan(int fd, const struct journal_header *jh, struct replay_index *ix,
+                        uint32_t keep, struct scan_end *end) {
+    return journal_is_block_fmt(jh) ? journal_scan_blocks(fd, jh, ix, keep, end)
+                                    : journal_scan_records(fd, jh, ix, keep, end);
+}
+
+/* Copy one logged image to its home block. copy_file_range keeps the data in the
+ * kernel (and block-aligned images let filesystems share extents instead of copying);
+ * fall back to read + write where it is not supported. Mapped, it is one memcpy. */
+static int install_block(int fd, uint32_t img_off, uint32_t block_no, uint8_t *buf) {
+    loff_t src = journal_base_off() + (off_t)img_off;
+    loff_t dst = blk_off(block_no);
+    if (img_map) {
+        int rc = map_check(src, geo.block_size, "install");
+        return rc < 0 ? rc : map_write(img_map + src, geo.block_size, dst, "install");
+    }
+    ssize_t n;
+    while ((n = copy_file_range(fd, &src, fd, &dst, geo.block_size, 0)) < 0 && errno == EINTR) {}
+    if (n == (ssize_t)geo.block_size) return 0;
+    if (n < 0 && errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)
+        return jfail_io("copy_file_range(install)", -1);
+    int rc = journal_read_bytes(fd, img_off, buf, geo.block_size);
+    return rc < 0 ? rc : write_block(fd, block_no, buf);
+}
+
+/* ----- parallel write-back -----
+ * After dedup the index is sorted by home block and every block has one run of
+ * entries, so the runs are split into contiguous block ranges of about equal size and
+ * each range is written back by its own thread. Ranges never share a block, so the
+ * workers need no locking; with positional I/O they all use the caller's fd. Small
+ * installs (the common checkpoint of a few metadata blocks) stay on the calling thread.
+ */
+
+#define INSTALL_MAX_THREADS   16
+#define INSTALL_MIN_PER_THREAD 32      /* home blocks a worker should have to be worth it */
+
+static unsigned install_threads;       /* 0: one per online CPU, up to INSTALL_MAX_THREADS */
+
+struct install_part {
+    int fd;
+    const struct replay_ent *ents;
+    uint32_t n;                        /* entries of this range */
+    uint32_t nwrites;
+    int rc;
+    char msg[256];                     /* jerr_msg of the worker if rc < 0 */
+};
+
+/* Build in img the block ents[0..n) (one block's run) installs: its image with the
+ * deltas applied, or the home block with the deltas applied if there is no image. */
+static int install_image(int fd, const struct replay_ent *ents, uint32_t n, uint8_t *img, uint8_t *z) {
+    const struct replay_ent *e = &ents[0];
+    int rc;
+    if (e->type == REC_DATA) {
+        rc = journal_read_bytes(fd, e->img_off, img, geo.block_size);
+    } else if (e->type == REC_ZDATA) {
+        rc = journal_read_bytes(fd, e->img_off, z, e->length);
+        if (rc == 0 && rle_decode(z, e->length, img, geo.block_size) < 0)   /* checked by the scan */
+            rc = jfail(EIO, "install: bad compressed image for block %u", e->block_no);
+    } else {
+        rc = read_block(fd, e->block_no, img);
+    }
+    for (uint32_t k = 0; k < n && rc == 0; k++)
+        if (ents[k].type == REC_DELTA)
+            rc = journal_read_bytes(fd, ents[k].img_off, img + ents[k].offset, ents[k].length);
+    return rc;
+}
+
+#ifdef HAVE_IO_URING
+#define URING_INSTALL_BATCH ((URING_ENTRIES - 1) / 2)   /* blocks per batch: read + write, and the fsync */
+
+/* install_range on a ring: a plain image is a READ from the journal linked to the WRITE
+ * home, anything else is built here and queued as a WRITE. Batches of
+ * URING_INSTALL_BATCH blocks; with --sync the last one ends in a draining fdatasync. */
+static int install_range_uring(struct uring *r, int fd, const struct replay_ent *ents, uint32_t n,
+                               uint32_t *nwrites) {
+    uint8_t *pool, *z = xmalloc_block();
+    if (posix_memalign((void **)&pool, geo.block_size, (size_t)URING_INSTALL_BATCH * geo.block_size) != 0)
+        oom();
+    unsigned used = 0;
+    int rc = 0;
+    for (uint32_t i = 0, j; i < n && rc == 0; i = j) {
+        const struct replay_ent *e = &ents[i];
+        for (j = i + 1; j < n && ents[j].block_no == e->block_no; j++) {}
+        if (used == URING_INSTALL_BATCH) {
+            if ((rc = uring_submit_wait(r, "io_uring(install)")) < 0) break;
+            used = 0;
+        }
+        uint8_t *img = pool + (size_t)used * geo.block_size;
+        if (j == i + 1 && e->type == REC_DATA) {
+            uring_queue(r, IORING_OP_READ, fd, img, geo.block_size,
+                        journal_base_off() + (off_t)e->img_off, 0, IOSQE_IO_LINK, geo.block_size);
+        } else if ((rc = install_image(fd, e, j - i, img, z)) < 0) {
+            break;
+        }
+        uring_queue(r, IORING_OP_WRITE, fd, img, geo.block_size, blk_off(e->block_no), 0, 0,
+                    geo.block_size);
+        used++;
+        (*nwrites)++;
+    }
+    if (rc == 0 && sync_mode != SYNC_NONE && *nwrites > 0)
+        uring_queue(r, IORING_OP_FSYNC, fd, NULL, 0, 0, IORING_FSYNC_DATASYNC, IOSQE_IO_DRAIN, 0);
+    int src = uring_submit_wait(r, "io_uring(install)");   /* also after an error: I/O in flight */
+    free(pool);
+    free(z);
+    return rc < 0 ? rc : src < 0 ? src : 1;
+}
+#endif
+
+/* Write back the blocks of ents[0..n), each once. Returns 1 if no barrier is needed
+ * after them any more (io_uring queued its own, or the mapped range was synced), 0 if
+ * the caller still owes one. */
+static int install_range(int fd, const struct replay_ent *ents, uint32_t n, uint32_t *nwrites) {
+#ifdef HAVE_IO_URING
+    struct uring *r = uring_get();
+    if (r) return install_range_uring(r, fd, ents, n, nwrites);
+#endif
+    uint8_t *img = xmalloc_block(), *z = xmalloc_block();
+    int rc = 0;
+    for (uint32_t i = 0, j; i < n && rc == 0; i = j) {
+        const struct replay_ent *e = &ents[i];
+        for (j = i + 1; j < n && ents[j].block_no == e->block_no; j++) {}
+        (*nwrites)++;
+        if (j == i + 1 && e->type == REC_DATA)         /* just an image: copy it over */
+            rc = install_block(fd, e->img_off, e->block_no, img);
+        else if ((rc = install_image(fd, e, j - i, img, z)) == 0)
+            rc = write_block(fd, e->block_no, img);
+    }
+    free(img);
+    free(z);
+    /* ents are sorted by block: msync from the first home block to the last */
+    if (rc == 0 && img_map && sync_mode != SYNC_NONE && n > 0) {
+        off_t lo = blk_off(ents[0].block_no);
+        rc = map_sync(lo, (size_t)(blk_off(ents[n - 1].block_no) - lo) + geo.block_size, "msync(home blocks)");
+        return rc < 0 ? rc : 1;
+    }
+    return rc;
+}
+
+static void *install_worker(void *arg) {
+    struct install_part *p = arg;
+    p->rc = install_range(p->fd, p->ents, p->n, &p->nwrites);
+    if (p->rc < 0) memcpy(p->msg, jerr_msg, sizeof(p->msg));
+    return NULL;
+}
+
+/* Write back a deduplicated index, in parallel when it is large enough. *nwrites
+ * counts home block writes; the first failing range's error is returned. Returns 1 if
+ * every range was made durable already (see install_range), 0 if not. */
+static int install_parallel(int fd, const struct replay_index *ix, uint32_t *nwrites) {
+    uint32_t nblocks = 0;
+    for (uint32_t i = 0; i < ix->n; i++)
+        if (i == 0 || ix->ents[i].block_no != ix->ents[i - 1].block_no) nblocks++;
+
+    unsigned nthr = install_threads;
+    if (nthr == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthr = ncpu > 0 ? (unsigned)ncpu : 1;
+    }
+    if (nthr > INSTALL_MAX_THREADS) nthr = INSTALL_MAX_THREADS;
+    if (nthr > nblocks / INSTALL_MIN_PER_THREAD) nthr = nblocks / INSTALL_MIN_PER_THREAD;
+    if (nthr <= 1) return install_range(fd, ix->ents, ix->n, nwrites);
+
+    /* cut after every nblocks/nthr blocks, at a block boundary */
+    struct install_part part[INSTALL_MAX_THREADS];
+    pthread_t tid[INSTALL_MAX_THREADS];
+    uint32_t start = 0, seen = 0;
+    for (unsigned t = 0; t < nthr; t++) {
+        uint32_t want = (uint32_t)((uint64_t)nblocks * (t + 1) / nthr), end = start;
+        while (end < ix->n &&
+               (seen < want || (end > start && ix->ents[end].block_no == ix->ents[end - 1].block_no))) {
+            if (end == start || ix->ents[end].block_no != ix->ents[end - 1].block_no) seen++;
+            end++;
+        }
+        part[t] = (struct install_part){ .fd = fd, .ents = ix->ents + start, .n = end - start };
+        start = end;
+    }
+
+    unsigned started = 0;
+    int rc = 1;
+    for (; started < nthr; started++)
+        if (pthread_create(&tid[started], NULL, install_worker, &part[started]) != 0) break;
+    for (unsigned t = started; t < nthr; t++)       /* could not start them all: do the rest here */
+        install_worker(&part[t]);
+    for (unsigned t = 0; t < nthr; t++) {
+        if (t < started) pthread_join(tid[t], NULL);
+        *nwrites += part[t].nwrites;
+        if (part[t].rc < 0 && rc >= 0) {
+            rc = part[t].rc;
+            memcpy(jerr_msg, part[t].msg, sizeof(jerr_msg));
+        } else if (part[t].rc == 0 && rc > 0) {
+            rc = 0;
+        }
+    }
+    return rc;
+}
+
+/* ----- read-your-writes overlay -----
+ * Until install, the latest committed copy of a block lives in the journal and its home
+ * block is stale. The overlay is the deduplicated replay index of the live log, so a
+ * read builds the block exactly as install would (install_image) without writing it
+ * home, and creates can go on while install is deferred. It is built by one scan and
+ * scanned again once head has moved (a checkpoint installed the old log and may reuse
+ * its space), or on a shared handle once tail or next_seq has (another process may
+ * have committed). An exclusive handle's own commits only log blocks its cache holds
+ * until they are home, so they need no rescan. Reads hold the journal lock, so the
+ * log stays put under them.
+ */
+struct overlay {
+    struct replay_index ix;
+    int valid;
+    uint32_t head_seq;                 /* log ix was scanned from */
+    uint32_t tail, next_seq;
+    uint8_t *z;                        /* ZDATA scratch */
+};
+
+static struct overlay *overlay_new(void) {
+    struct overlay *ov = xmalloc(sizeof(*ov));
+    memset(ov, 0, sizeof(*ov));
+    ov->z = xmalloc_block();
+    return ov;
+}
+
+static void overlay_free(struct overlay *ov) {
+    free(ov->ix.ents);
+    free(ov->z);
+    free(ov);
+}
+
+static void overlay_invalidate(struct overlay *ov) {
+    ov->valid = 0;
+}
+
+static int overlay_read_locked(struct overlay *ov, int fd, uint32_t blkno, uint8_t *buf) {
+    struct journal_header jh;
+    int rc = journal_read_header(fd, &jh);
+    if (rc < 0) return rc;
+    if (!ov->valid || jh.head_seq != ov->head_seq ||
+        (!journal_owned && (jh.tail != ov->tail || jh.next_seq != ov->next_seq))) {
+        ov->valid = 0;
+        ov->ix.n = 0;
+        struct scan_end end;
+        if ((rc = journal_scan(fd, &jh, &ov->ix, 0, &end)) < 0) return rc;
+        replay_dedup(&ov->ix);
+        ov->head_seq = jh.head_seq;
+        ov->tail = jh.tail;
+        ov->next_seq = jh.next_seq;
+        ov->valid = 1;
+    }
+
+    /* first entry of blkno's run */
+    uint32_t lo = 0, hi = ov->ix.n;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (ov->ix.ents[mid].block_no < blkno) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == ov->ix.n || ov->ix.ents[lo].block_no != blkno) return read_block(fd, blkno, buf);
+    for (hi = lo + 1; hi < ov->ix.n && ov->ix.ents[hi].block_no == blkno; hi++) {}
+    return install_image(fd, &ov->ix.ents[lo], hi - lo, buf, ov->z);
+}
+
+/* Latest committed contents of blkno into buf */
+static int overlay_read(struct overlay *ov, int fd, uint32_t blkno, uint8_t *buf) {
+    int rc = journal_lock(fd);
+    if (rc < 0) return rc;
+    rc = overlay_read_locked(ov, fd, blkno, buf);
+    journal_unlock(fd);
+    return rc;
+}
+
+/* Checkpoint the live log as it was when it started, or with low > 0 only its oldest
+ * transactions, until at most low bytes of the journal stay in use. Called with
+ * ckpt_mutex and the flock held: home blocks are written without jh_mutex, so this
+ * process keeps appending meanwhile, and afterwards only head moves. Returns 0 if there
+ * was nothing to install, 1 otherwise; st may be NULL. On error head has not moved, so
+ * the next checkpoint replays the same transactions again. */
+static int journal_checkpoint_locked(int fd, struct journal_install_stats *st, uint64_t gen, uint32_t low) {
+    struct journal_header snap;
+    int rc = journal_lock(fd);
+    if (rc < 0) return rc;
+    rc = journal_read_header(fd, &snap);
+    journal_unlock(fd);
+    if (rc < 0) return rc;
+
+    uint32_t log_start = journal_log_start(&snap);
+    uint32_t keep = low > log_start ? low - log_start : 0;     /* live bytes that may stay */
+    if (snap.nbytes_used == log_start) {
+        __atomic_store_n(&ckpt_gen, gen, __ATOMIC_RELEASE);   /* nothing left to install, all home */
+        return 0;
+    }
+    if (snap.nbytes_used - log_start <= keep) return 0;
+
+    struct replay_index ix = {0};
+    struct scan_end end;
+    int ntxn = journal_scan(fd, &snap, &ix, keep, &end);
+    if (ntxn < 0) {
+        free(ix.ents);
+        return ntxn;
+    }
+    uint32_t nrec = ix.n;
+    replay_dedup(&ix);
+
+    uint32_t nwrites = 0;
+    int durable = install_parallel(fd, &ix, &nwrites);
+    rc = durable < 0 ? durable : 0;
+    free(ix.ents);
+    /* home blocks must be durable before head moves past their journal copies */
+    if (rc == 0 && sync_mode != SYNC_NONE && nwrites > 0 && !durable)
+        rc = journal_barrier(fd, "fdatasync(home blocks)");
+    if (rc < 0) return rc;
+
+    /* checkpoint: free everything up to the snapshot's tail (a torn tail included), or
+     * when stopping early, up to the end of the last installed transaction. Appends
+     * since the snapshot only moved tail, so the header is adjusted, not replaced. */
+    int partial = keep > 0 && end.bytes < snap.nbytes_used - log_start;
+    struct journal_header jh;
+    if ((rc = journal_lock(fd)) < 0) return rc;
+    if ((rc = journal_read_header(fd, &jh)) == 0) {
+        jh.nbytes_used -= partial ? end.bytes : snap.nbytes_used - log_start;
+        jh.head = partial ? end.off : snap.tail;
+        jh.head_seq = partial ? snap.head_seq + (uint32_t)ntxn : snap.next_seq;
+        /* empty: restart at the front for contiguous space. With concurrent appends
+         * only while nothing is claimed past tail; moving the claim position first
+         * makes a racing claim retry against the new one. */
+        uint64_t at_tail = pos_pack(jh.tail, jh.next_seq);
+        if (jh.nbytes_used == log_start &&
+            (!journal_owned ||
+             __atomic_compare_exchange_n(&app.pos, &at_tail, pos_pack(log_start, jh.next_seq), 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))) {
+            jh.head = log_start;
+            jh.tail = log_start;
+        }
+        rc = journal_write_header(fd, &jh);
+        if (rc == 0 && sync_mode == SYNC_FULL) rc = journal_header_barrier(fd);
+        if (rc == 0 && journal_owned)
+            __atomic_store_n(&app.headpos, pos_pack(jh.head, jh.head_seq), __ATOMIC_RELEASE);
+    }
+    journal_unlock(fd);
+    if (rc < 0) return rc;
+
+    if (!partial) __atomic_store_n(&ckpt_gen, gen, __ATOMIC_RELEASE);
+    if (st) {
+        st->ntxn = (uint32_t)ntxn;
+        st->nrec = nrec;
+        st->nwrites = nwrites;
+    }
+    return 1;
+}
+
+/* Checkpoint down to low bytes in use (journal_checkpoint_locked); 0 installs all */
+static int journal_checkpoint_to(int fd, struct journal_install_stats *st, uint32_t low) {
+    /* one at a time: two overlapping replays could leave an older image at home. The
+     * flock keeps other processes from appending or checkpointing until head moved. */
+    pthread_mutex_lock(&ckpt_mutex);
+    uint64_t gen = __atomic_add_fetch(&ckpt_started, 1, __ATOMIC_ACQ_REL);
+    int rc = journal_flock(fd);
+    if (rc == 0) {
+        rc = journal_checkpoint_locked(fd, st, gen, low);
+        journal_funlock(fd);
+    }
+    pthread_mutex_unlock(&ckpt_mutex);
+    return rc;
+}
+
+/* Cut the log back to the end of its last valid transaction. A scan stops at a torn or
+ * corrupt one (a crash during an append, a bad block), so a transaction appended after
+ * it would be committed but never replayed: appends must start where the scan ends. */
+static int journal_recover(int fd) {
+    int rc = journal_lock(fd);
+    if (rc < 0) return rc;
+    struct journal_header jh;
+    if ((rc = journal_read_header(fd, &jh)) < 0) {
+        journal_unlock(fd);
+        return rc;
+    }
+    uint32_t log_start = journal_log_start(&jh);
+    struct replay_index ix = {0};
+    struct scan_end end;
+    int ntxn = journal_scan(fd, &jh, &ix, 0, &end);
+    free(ix.ents);
+    if (ntxn >= 0 && end.bytes < jh.nbytes_used - log_start) {
+        jh.tail = end.off;
+        jh.next_seq = jh.head_seq + (uint32_t)ntxn;
+        jh.nbytes_used = log_start + end.bytes;
+        if (ntxn == 0) jh.head = jh.tail = log_start;
+        rc = journal_write_header(fd, &jh);
+        if (rc == 0 && sync_mode == SYNC_FULL) rc = journal_header_barrier(fd);
+    }
+    journal_unlock(fd);
+    return ntxn < 0 ? ntxn : rc;
+}
+
+static int journal_checkpoint(int fd, struct journal_install_stats *st) {
+    return journal_checkpoint_to(fd, st, 0);
+}
+
+/* =========================
+ *            MKFS
+ * =========================
+ * Builds an empty image: root directory (inode 0, "." and "..") in the first data
+ * block, empty journal. Without options this is the original 85-block layout.
+ */
+
+static uint32_t div_round_up(uint64_t a, uint64_t b) {
+    return (uint32_t)((a + b - 1) / b);
+}
+
+/* The open handle, if any: the geometry and options are process-wide */
+static struct journal *open_journal;
+
+static void journal_reset(void);
+
+int journal_mkfs(const char *path, struct journal_mkfs_params *p) {
+    if (open_journal) return jfail(EBUSY, "mkfs: a journal is open in this process");
+    uint64_t bs = p->block_size ? p->block_size : BLOCK_SIZE;
+    uint64_t jblocks = p->journal_blocks ? p->journal_blocks : JOURNAL_NBLOCKS;
+    uint64_t inodes = p->inodes, total = p->total_blocks;
+    if (!is_pow2((uint32_t)bs) || bs < MIN_BLOCK_SIZE || bs > MAX_BLOCK_SIZE)
+        return jfail(EINVAL, "mkfs: block size must be a power of two in %d..%d", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+    if (jblocks < MIN_JOURNAL_NBLOCKS)
+        return jfail(EINVAL, "mkfs: journal needs at least %d blocks", MIN_JOURNAL_NBLOCKS);
+    if (p->format != JOURNAL_FORMAT_RECORD && p->format != JOURNAL_FORMAT_BLOCK)
+        return jfail(EINVAL, "mkfs: unknown journal format %d", (int)p->format);
+
+    uint64_t bits = bs * 8;
+    uint32_t ipb = (uint32_t)(bs / sizeof(struct inode));
+    if (inodes == 0) inodes = (uint64_t)INODE_TBL_NBLOCKS * ipb;
+    if (inodes < 2) inodes = 2;
+    uint32_t itbl_n = div_round_up(inodes, ipb);
+    inodes = (uint64_t)itbl_n * ipb;
+    uint32_t ibm_n = div_round_up(inodes, bits);
+
+    uint64_t fixed = 1 + jblocks + ibm_n + itbl_n;     /* everything but data bitmap + data */
+    uint64_t data, dbm_n;
+    if (total == 0) {
+        data = DATA_NBLOCKS;
+        dbm_n = div_round_up(data, bits);
+        total = fixed + dbm_n + data;
+    } else {
+        if (total < fixed + 2) return jfail(EINVAL, "mkfs: %llu blocks leave no room for data",
+                                            (unsigned long long)total);
+        dbm_n = div_round_up(total - fixed, bits + 1);
+        data = total - fixed - dbm_n;
+    }
+    if (total > UINT32_MAX || jblocks * bs > UINT32_MAX) return jfail(EINVAL, "mkfs: image too large");
+
+    struct superblock sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = FS_MAGIC;
+    sb.block_size = (uint32_t)bs;
+    sb.total_blocks = (uint32_t)total;
+    sb.inode_count = (uint32_t)inodes;
+    sb.journal_block = JOURNAL_START_BLK;
+    sb.inode_bitmap = (uint32_t)(JOURNAL_START_BLK + jblocks);
+    sb.data_bitmap = sb.inode_bitmap + ibm_n;
+    sb.inode_start = sb.data_bitmap + (uint32_t)dbm_n;
+    sb.data_start = sb.inode_start + itbl_n;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return jfail(errno, "open(%s): %s", path, strerror(errno));
+    int rc = 0;
+    ssize_t n;
+    if (ftruncate(fd, (off_t)total * (off_t)bs) < 0) rc = jfail_io("ftruncate", -1);
+    else if ((n = pwrite_full(fd, &sb, sizeof(sb), 0)) != (ssize_t)sizeof(sb)) rc = jfail_io("pwrite(superblock)", n);
+    else rc = geometry_load(fd);
+    if (rc < 0) {
+        close(fd);
+        journal_reset();
+        return rc;
+    }
+
+    uint8_t *blk = xmalloc(geo.block_size);
+    uint32_t now = (uint32_t)time(NULL);
+
+    memset(blk, 0, geo.block_size);
+    bitmap_set(blk, ROOT_INO);
+    rc = write_block(fd, geo.inode_bmap, blk);
+
+    memset(blk, 0, geo.block_size);
+    bitmap_set(blk, 0);                       /* first data block = root directory */
+    if (rc == 0) rc = write_block(fd, geo.data_bmap, blk);
+
+    memset(blk, 0, geo.block_size);
+    struct inode *root = (struct inode *)blk + ROOT_INO;
+    root->type = INODE_TYPE_DIR;
+    root->links = 2;
+    root->size = 2 * (uint32_t)sizeof(struct dirent);
+    root->direct[0] = geo.data_start;
+    root->ctime = now;
+    root->mtime = now;
+    if (rc == 0) rc = write_block(fd, geo.inode_tbl, blk);
+
+    memset(blk, 0, geo.block_size);
+    struct dirent *de = (struct dirent *)blk;
+    de[0].inode = ROOT_INO;
+    strcpy(de[0].name, ".");
+    de[1].inode = ROOT_INO;
+    strcpy(de[1].name, "..");
+    if (rc == 0) rc = write_block(fd, geo.data_start, blk);
+    free(blk);
+
+    new_journal_version = p->format == JOURNAL_FORMAT_BLOCK ? JOURNAL_VERSION_BLOCK : JOURNAL_VERSION_RECORD;
+    if (rc == 0) rc = journal_init_if_needed(fd);
+    if (rc == 0 && fsync(fd) < 0) rc = jfail_io("fsync", -1);
+    close(fd);
+    if (rc == 0) {
+        p->block_size = geo.block_size;
+        p->journal_blocks = geo.journal_nblocks;
+        p->inodes = geo.inode_count;
+        p->total_blocks = geo.total_blocks;
+        p->data_blocks = geo.data_nblocks;
+    }
+    /* the geometry, header cache and format were this image's: a later journal_open
+     * must not find them */
+    journal_reset();
+    return rc;
+}
+
+/* =========================
+ *        LIBRARY API
+ * =========================
+ * A handle is the image's fd plus the group-commit batch that journal_create feeds;
+ * everything else (geometry, options, header cache) is process state set by
+ * journal_open and cleared by journal_close.
+ */
+
+struct journal {
+    int fd;
+    struct batch b;
+};
+
+/* Drop the process state of a handle that is going away */
+static void journal_reset(void) {
+    ckpt_bg_stop();
+    if (direct_fd >= 0) close(direct_fd);
+    direct_fd = -1;
+    journal_owned = 0;
+    flock_refs = 0;                            /* a failed close leaves a group's flock */
+    jh_cache_valid = 0;
+    sync_mode = SYNC_NONE;
+    checkpoint_pct = 100;
+    full_images = 0;
+    install_threads = 0;
+    use_uring = 0;
+    uring_put();
+    if (img_map) munmap(img_map, img_map_len);
+    img_map = NULL;
+    img_map_len = 0;
+    new_journal_version = JOURNAL_VERSION;
+    memset(&geo, 0, sizeof(geo));
+    open_journal = NULL;
+}
+
+/* --mmap: map the whole image as the superblock describes it */
+static int journal_map(int fd, const struct journal_options *opt) {
+    if (opt->direct) return jfail(EINVAL, "mmap and O_DIRECT journal writes do not mix");
+    struct stat st;
+    if (fstat(fd, &st) < 0) return jfail_io("fstat(image)", -1);
+    size_t len = (size_t)blk_off(geo.total_blocks);
+    if ((uint64_t)st.st_size < len)        /* a mapping past EOF would SIGBUS */
+        return jfail(EINVAL, "image is %lld bytes, its superblock says %zu", (long long)st.st_size, len);
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) return jfail_io("mmap(image)", -1);
+    img_map = p;
+    img_map_len = len;
+    return 0;
+}
+
+int journal_open(const char *path, const struct journal_options *opt, struct journal **jp) {
+    static const struct journal_options defaults = { 100, JOURNAL_SYNC_NONE, 0, 0, 0, 0, 0, 0, 0, 0 };
+    if (!opt) opt = &defaults;
+    if (open_journal) return jfail(EBUSY, "a journal is already open in this process");
+    if (opt->checkpoint_pct > 100 ||
+        (opt->background_checkpoint &&
+         opt->checkpoint_low_pct >= (opt->checkpoint_pct ? opt->checkpoint_pct : 100)) ||
+        (opt->sync != JOURNAL_SYNC_NONE && opt->sync != JOURNAL_SYNC_COMMIT && opt->sync != JOURNAL_SYNC_FULL))
+        return jfail(EINVAL, "bad journal options");
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0) return jfail(errno, "open(%s): %s", path, strerror(errno));
+    int rc = geometry_load(fd);
+    if (rc == 0 && opt->direct && (direct_fd = open(path, O_RDWR | O_DIRECT)) < 0)
+        rc = jfail(errno, "open(%s, O_DIRECT): %s", path, strerror(errno));
+    if (rc == 0 && opt->mmap_image) rc = journal_map(fd, opt);
+    if (rc == 0 && opt->exclusive) rc = journal_own(fd);
+    sync_mode = (enum sync_mode)opt->sync;
+    checkpoint_pct = opt->checkpoint_pct ? opt->checkpoint_pct : 100;
+    full_images = opt->full_images;
+    install_threads = opt->install_threads;
+    use_uring = opt->io_uring && !img_map;
+    if (rc == 0) rc = journal_init_if_needed(fd);
+    if (rc == 0) rc = journal_recover(fd);     /* appends must start after the last commit */
+    if (rc == 0 && journal_owned) {
+        struct journal_header jh;
+        if ((rc = journal_read_header(fd, &jh)) == 0) journal_append_init(&jh);
+    }
+
+    struct journal *j = NULL;
+    if (rc == 0) {
+        j = xmalloc(sizeof(*j));
+        j->fd = fd;
+        rc = batch_open(&j->b, fd);
+        if (rc == 0 && opt->background_checkpoint) rc = ckpt_bg_start(fd, opt->checkpoint_low_pct);
+    }
+    if (rc < 0) {
+        if (j && j->b.ms) meta_free(j->b.ms);
+        free(j);
+        close(fd);
+        journal_reset();
+        return rc;
+    }
+    open_journal = j;
+    *jp = j;
+    return 0;
+}
+
+int journal_close(struct journal *j) {
+    int rc = batch_close(&j->b);
+    ckpt_bg_stop();
+    close(j->fd);
+    free(j);
+    journal_reset();
+    return rc;
+}
+
+int journal_txn_begin(struct journal *j, struct journal_txn **tp) {
+    struct txn *t = xmalloc(sizeof(*t));
+    txn_begin(t);
+    t->j = j;
+    *tp = (struct journal_txn *)t;
+    return 0;
+}
+
+int journal_txn_log_block(struct journal_txn *tp, uint32_t block_no, const void *image) {
+    struct txn *t = (struct txn *)tp;
+    if (block_no < geo.inode_bmap || block_no >= geo.total_blocks)
+        return jfail(EINVAL, "txn: block %u is not a journaled block", block_no);
+    return txn_log_block(t, block_no, image);
+}
+
+/* Safe to call from several threads at once; on an exclusive handle their records are
+ * written in parallel (concurrent append). */
+int journal_txn_commit(struct journal_txn *tp) {
+    struct txn *t = (struct txn *)tp;
+    struct journal *j = t->j;
+    struct journal_header jh;
+    int rc = 0;
+    if (t->nrecs > 0 && (rc = journal_read_header(j->fd, &jh)) == 0 &&
+        (rc = journal_make_room(j->fd, &jh, txn_bytes(&jh, t->nrecs))) >= 0) {
+        __atomic_add_fetch(&j->b.ckpts, (unsigned)rc, __ATOMIC_RELAXED);
+        rc = txn_commit(j->fd, &jh, t);
+    }
+    free(t);
+    return rc;
+}
+
+void journal_txn_abort(struct journal_txn *tp) {
+    free(tp);
+}
+
+int journal_create(struct journal *j, const char *name, uint32_t *ino) {
+    jerr_msg[0] = '\0';
+    int rc = batch_create(&j->b, name, ino);
+    if (rc < 0 && jerr_msg[0] == '\0') jfail(-rc, "'%s': %s", name, strerror(-rc));
+    return rc;
+}
+
+int journal_flush(struct journal *j) {
+    return batch_flush(&j->b);
+}
+
+int journal_install(struct journal *j, struct journal_install_stats *st) {
+    int rc = batch_flush(&j->b);
+    if (rc < 0) return rc;
+    if (st) memset(st, 0, sizeof(*st));
+    rc = journal_checkpoint(j->fd, st);
+    int hrc = journal_read_header(j->fd, &j->b.jh);
+    return rc < 0 ? rc : hrc < 0 ? hrc : rc;
+}
+
+void journal_get_layout(const struct journal *j, struct journal_layout *l) {
+    (void)j;
+    l->block_size = geo.block_size;
+    l->total_blocks = geo.total_blocks;
+    l->journal_blocks = geo.journal_nblocks;
+    l->first_logged = geo.inode_bmap;
+    l->data_start = geo.data_start;
+}
+
+void journal_get_stats(const struct journal *j, struct journal_stats *st) {
+    st->created = j->b.created;
+    st->failed = j->b.failed;
+    st->groups = j->b.groups;
+    st->records = j->b.records;
+    st->checkpoints = j->b.ckpts;
+    pthread_mutex_lock(&ckpt_bg.lock);
+    st->bg_checkpoints = ckpt_bg.passes;
+    pthread_mutex_unlock(&ckpt_bg.lock);
+    st->meta_hits = j->b.ms->hits;
+    st->meta_misses = j->b.ms->misses;
+}
+
+journal_crc_fn journal_crc32c_kernel(const char *name) {
+    pthread_once(&crc32c_once, crc32c_init);   /* build tables, pick the kernel */
+    if (strcmp(name, "auto") == 0) return crc32c_impl;
+    if (strcmp(name, "table") == 0) return crc32c_sw;
+    if (strcmp(name, "sse4.2") == 0) return crc32c_have_hw() ? crc32c_hw : NULL;
+    return NULL;
+}
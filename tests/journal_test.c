@@ -0,0 +1,559 @@
+/*
+ * journal_test.c - unit tests and image helpers for tests/run.sh
+ *
+ * Includes libjournal.c, so its static functions can be called directly.
+ *
+ *   journal_test unit     run the unit tests
+ *   journal_test ls       list the root directory of vsfs.img as installed ("name inode")
+ *   journal_test tear     flip a byte of the last transaction in the journal of vsfs.img
+ *   journal_test replay   check install's DATA/DELTA order on vsfs.img (record format)
+ *   journal_test threads [mmap|background]
+ *                         commit from several threads through an exclusive handle
+ *   journal_test install [uring]   install many home blocks with a worker pool
+ *   journal_test direct   commit an unaligned image through O_DIRECT (block format)
+ *   journal_test cache    exercise the metadata cache on vsfs.img (32 KiB blocks)
+ *   journal_test bitmaps  allocate every free inode and data block of vsfs.img through
+ *                         the free-space summaries (bitmaps of several blocks)
+ */
+
+#include "../libjournal.c"
+
+static int failures;
+
+/* Image helpers stop at the first failure */
+static void die_rc(const char *what, int rc) {
+    if (rc >= 0) return;
+    fprintf(stderr, "%s: %s\n", what, journal_errmsg()[0] ? journal_errmsg() : strerror(-rc));
+    exit(1);
+}
+
+#define CHECK(cond) do {                                                        \
+        if (!(cond)) {                                                          \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                         \
+        }                                                                       \
+    } while (0)
+
+/* =========================
+ *        UNIT TESTS
+ * ========================= */
+
+static void test_crc32c(void) {
+    CHECK(crc32c(0, "123456789", 9) == 0xe3069283u);      /* the CRC-32C check value */
+    CHECK(crc32c(0, "", 0) == 0);
+
+    /* continuing a checksum gives the same result as one call over everything */
+    uint8_t buf[1000];
+    for (size_t i = 0; i < sizeof(buf); i++) buf[i] = (uint8_t)(i * 7 + 3);
+    uint32_t whole = crc32c(0, buf, sizeof(buf));
+    for (size_t cut = 0; cut <= sizeof(buf); cut += 111)
+        CHECK(crc32c(crc32c(0, buf, cut), buf + cut, sizeof(buf) - cut) == whole);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+/* The SSE4.2/PCLMUL kernel against the table one, at every start alignment and at
+ * lengths around the 3-stream lane boundaries */
+static void test_crc32c_kernels(void) {
+    pthread_once(&crc32c_once, crc32c_init);
+    if (!crc32c_have_hw()) {
+        printf("unit: no sse4.2+pclmul, kernel comparison skipped\n");
+        return;
+    }
+    size_t max = 2 * 3 * CRC32C_LONG + 64;
+    uint8_t *buf = xmalloc(max + 8);
+    for (size_t i = 0; i < max + 8; i++) buf[i] = (uint8_t)(i * 131 + (i >> 7));
+    size_t lens[] = { 0, 1, 7, 8, 9, 63, 3 * CRC32C_SHORT - 1, 3 * CRC32C_SHORT, 3 * CRC32C_SHORT + 5,
+                      512, 4096 - 1, 3 * CRC32C_LONG - 1, 3 * CRC32C_LONG, 3 * CRC32C_LONG + 13,
+                      4096, 4096 + 3, max };
+    for (size_t a = 0; a < 8; a++)
+        for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+            CHECK(crc32c_hw(0, buf + a, lens[i]) == crc32c_sw(0, buf + a, lens[i]));
+            CHECK(crc32c_hw(0x12345678u, buf + a, lens[i]) == crc32c_sw(0x12345678u, buf + a, lens[i]));
+        }
+    for (size_t n = 0; n < 600; n++)
+        CHECK(crc32c_hw(~0u, buf + n % 8, n) == crc32c_sw(~0u, buf + n % 8, n));
+    free(buf);
+}
+
+#else
+
+static void test_crc32c_kernels(void) {}
+
+#endif
+
+/* journal_mkfs leaves no process state behind: a block-format mkfs of another size
+ * must not change the geometry or the journal format a later open sees */
+static void test_mkfs_state(void) {
+    char path[] = "mkfs-state.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) die_rc("mkstemp", -errno);
+    close(fd);
+    struct journal_mkfs_params p = { 1024, 32, 0, 0, 0, JOURNAL_FORMAT_BLOCK };
+    die_rc("mkfs", journal_mkfs(path, &p));
+    unlink(path);
+    CHECK(p.block_size == 1024 && p.journal_blocks == 32);
+    CHECK(geo.block_size == 0 && geo.total_blocks == 0);
+    CHECK(new_journal_version == JOURNAL_VERSION && !jh_cache_valid);
+}
+
+/* Free-bit search: one clear bit anywhere in a full bitmap, searched from below and
+ * at it, is found by bitmap_ffz and by every byte kernel the CPU has */
+static void test_bitmap_ffz(void) {
+    enum { N = 700 };                        /* bytes: past the 32-byte kernel loop */
+    uint8_t bmap[N];
+    uint32_t (*kernels[3])(const uint8_t *, uint32_t) = { ffz_bytes_sw };
+    int nk = 1;
+#if defined(__x86_64__) && defined(__GNUC__)
+    kernels[nk++] = ffz_bytes_sse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) kernels[nk++] = ffz_bytes_avx2;
+#endif
+    memset(bmap, 0xff, N);
+    CHECK(bitmap_ffz(bmap, 0, N * 8) == N * 8);
+    CHECK(bitmap_ffz(bmap, 0, N * 8 - 3) == N * 8 - 3);
+    for (uint32_t bit = 0; bit < N * 8; bit += bit < 80 ? 1 : 37) {
+        bmap[bit / 8] &= (uint8_t)~(1u << bit % 8);
+        for (int k = 0; k < nk; k++)
+            for (uint32_t a = 0; a < 8 && a <= bit / 8; a++)
+                CHECK(kernels[k](bmap + a, N - a) == bit / 8 - a);
+        CHECK(bitmap_ffz(bmap, 0, N * 8) == bit);
+        CHECK(bitmap_ffz(bmap, bit, N * 8) == bit);
+        CHECK(bitmap_ffz(bmap, bit + 1, N * 8) == N * 8);
+        CHECK(bitmap_ffz(bmap, 0, bit) == bit);           /* past the end it does not count */
+        bmap[bit / 8] = 0xff;
+    }
+}
+
+/* ZDATA codec: patterns round-trip, a too small cap is refused and a damaged stream
+ * is rejected */
+static void test_rle(void) {
+    enum { N = 70000 };                     /* runs and literal spans past RLE_MAX_TOKEN */
+    uint8_t *in = xmalloc(N), *enc = xmalloc(2 * N), *out = xmalloc(N);
+    for (int pat = 0; pat < 6; pat++) {
+        for (uint32_t i = 0; i < N; i++) {
+            switch (pat) {
+            case 0: in[i] = 0; break;                                   /* one long run */
+            case 1: in[i] = (uint8_t)(i * 2654435761u >> 24); break;   /* no runs */
+            case 2: in[i] = (uint8_t)(i / 4); break;                    /* runs just too short */
+            case 3: in[i] = (uint8_t)(i / RLE_MIN_RUN); break;          /* shortest runs */
+            case 4: in[i] = i % 97 < 90 ? 0xff : (uint8_t)i; break;     /* bitmap-like */
+            default: in[i] = i >= N - 3 ? 1 : 0; break;                 /* short run at the end */
+            }
+        }
+        for (uint32_t n = 0; n <= N; n = n < 20 ? n + 1 : n * 3 + 1) {
+            uint32_t len = rle_encode(in, n, enc, 2 * N);
+            CHECK(len > 0 || n == 0);
+            CHECK(rle_decode(enc, len, out, n) == 0 && memcmp(in, out, n) == 0);
+            if (len > 2) {
+                CHECK(rle_encode(in, n, enc, len - 1) == 0);
+                uint32_t again = rle_encode(in, n, enc, len);
+                CHECK(again == len);
+                CHECK(rle_decode(enc, len - 1, out, n) < 0);     /* truncated */
+                CHECK(rle_decode(enc, len, out, n - 1) < 0);     /* longer than the block */
+            }
+        }
+    }
+    memset(in, 0, 4096);
+    CHECK(rle_encode(in, 4096, enc, 2 * N) == 3);
+    free(in);
+    free(enc);
+    free(out);
+}
+
+/* Positional helpers: a many-segment pwritev_full lands at its offset, and pread_full
+ * stops short only at end of file */
+static void test_full_io(void) {
+    char path[] = "full-io.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) die_rc("mkstemp", -errno);
+    unlink(path);
+    uint8_t src[3000], dst[3100];
+    for (size_t i = 0; i < sizeof(src); i++) src[i] = (uint8_t)(i * 13 + 5);
+    struct iovec iov[5];
+    size_t cuts[] = { 0, 1, 512, 513, 2047, sizeof(src) };
+    for (int i = 0; i < 5; i++)
+        iov[i] = (struct iovec){ src + cuts[i], cuts[i + 1] - cuts[i] };
+    CHECK(pwritev_full(fd, iov, 5, 100) == (ssize_t)sizeof(src));
+    CHECK(pread_full(fd, dst, sizeof(src), 100) == (ssize_t)sizeof(src));
+    CHECK(memcmp(src, dst, sizeof(src)) == 0);
+    CHECK(pread_full(fd, dst, sizeof(dst), 100) == (ssize_t)sizeof(src));
+    CHECK(pwrite_full(fd, src, 10, 0) == 10 && pread_full(fd, dst, 10, 0) == 10);
+    CHECK(memcmp(src, dst, 10) == 0);
+    close(fd);
+}
+
+/* =========================
+ *      IMAGE HELPERS
+ * ========================= */
+
+static int open_image(void) {
+    int fd = open("vsfs.img", O_RDWR);
+    if (fd < 0) die_rc("open(vsfs.img)", -errno);
+    die_rc("vsfs.img", geometry_load(fd));
+    return fd;
+}
+
+static void list_root(void) {
+    int fd = open_image();
+    uint8_t *blk = xmalloc_block();
+    die_rc("ls", read_block(fd, geo.inode_tbl, blk));
+    struct inode root = ((struct inode *)blk)[0];
+    uint32_t n = root.size / (uint32_t)sizeof(struct dirent);
+    for (uint32_t i = 0; i < n; i++) {
+        if (i % geo.dirents_per_block == 0)
+            die_rc("ls", read_block(fd, root.direct[i / geo.dirents_per_block], blk));
+        const struct dirent *de = &((const struct dirent *)blk)[i % geo.dirents_per_block];
+        if (de->name[0] == '\0' || strcmp(de->name, ".") == 0 || strcmp(de->name, "..") == 0) continue;
+        printf("%.*s %u\n", NAME_LEN, de->name, de->inode);
+    }
+    free(blk);
+    close(fd);
+}
+
+/* The byte in front of the last COMMIT: the end of the last image in both formats */
+static void tear_tail(void) {
+    int fd = open_image();
+    struct journal_header jh;
+    die_rc("tear", journal_read_header(fd, &jh));
+    if (jh.nbytes_used == journal_log_start(&jh)) {
+        fprintf(stderr, "tear: journal empty\n");
+        exit(1);
+    }
+    uint32_t commit = journal_is_block_fmt(&jh) ? geo.block_size : (uint32_t)COMMIT_REC_SIZE;
+    off_t off = journal_base_off() + (off_t)(jh.tail - commit - 1);
+    uint8_t b;
+    if (pread(fd, &b, 1, off) != 1) die_rc("pread(tear)", -EIO);
+    b ^= 0xff;
+    if (pwrite(fd, &b, 1, off) != 1) die_rc("pwrite(tear)", -EIO);
+    close(fd);
+}
+
+/* =========================
+ *       IMAGE TESTS
+ * ========================= */
+
+/* Install must apply a block's DELTA records in log order on top of its latest full
+ * image (DATA or ZDATA, or the home block), and a later image must drop the deltas
+ * before it. */
+static void test_replay_order(void) {
+    int fd = open_image();
+    die_rc("replay", journal_init_if_needed(fd));
+    struct journal_header jh;
+    die_rc("replay", journal_read_header(fd, &jh));
+
+    uint32_t x = geo.total_blocks - 1, y = geo.total_blocks - 2, z = geo.total_blocks - 3;
+    uint32_t w = geo.total_blocks - 4;
+    uint8_t *img = xmalloc_block(), *raw = xmalloc_block();
+    uint8_t *home = xmalloc_block(), *want = xmalloc_block();
+    for (uint32_t i = 0; i < geo.block_size; i++) raw[i] = (uint8_t)(i * 2654435761u >> 24);
+    memset(home, 'h', geo.block_size);
+    die_rc("replay", write_block(fd, y, home));
+    die_rc("replay", write_block(fd, z, home));
+
+    struct txn t;
+    memset(img, 'a', geo.block_size);
+    txn_begin(&t);
+    txn_log_block(&t, x, img);                        /* x: ZDATA image, then deltas */
+    txn_log_block(&t, w, raw);                        /* w: DATA image, then a delta */
+    txn_log_delta(&t, z, "zz", 7, 2);                 /* z: delta, then an image */
+    die_rc("replay", txn_commit(fd, &jh, &t));
+
+    txn_begin(&t);
+    txn_log_delta(&t, x, "bbbbb", 10, 5);
+    txn_log_delta(&t, x, "cc", 12, 2);                /* overlaps the one before */
+    txn_log_delta(&t, y, "yyy", 0, 3);                /* y: deltas on the home block */
+    txn_log_delta(&t, w, "ww", 100, 2);
+    txn_log_block(&t, z, img);
+    die_rc("replay", txn_commit(fd, &jh, &t));
+
+    txn_begin(&t);
+    txn_log_delta(&t, x, "d", geo.block_size - 1, 1);
+    txn_log_delta(&t, y, "Y", 1, 1);
+    die_rc("replay", txn_commit(fd, &jh, &t));
+
+    die_rc("replay", journal_checkpoint(fd, NULL));
+
+    memset(want, 'a', geo.block_size);
+    memcpy(want + 10, "bbccb", 5);
+    want[geo.block_size - 1] = 'd';
+    die_rc("replay", read_block(fd, x, home));
+    CHECK(memcmp(home, want, geo.block_size) == 0);
+
+    memset(want, 'h', geo.block_size);
+    memcpy(want, "yYy", 3);
+    die_rc("replay", read_block(fd, y, home));
+    CHECK(memcmp(home, want, geo.block_size) == 0);
+
+    die_rc("replay", read_block(fd, z, home));
+    CHECK(memcmp(home, img, geo.block_size) == 0);
+
+    memcpy(want, raw, geo.block_size);
+    memcpy(want + 100, "ww", 2);
+    die_rc("replay", read_block(fd, w, home));
+    CHECK(memcmp(home, want, geo.block_size) == 0);
+
+    free(img);
+    free(raw);
+    free(home);
+    free(want);
+    close(fd);
+}
+
+/* Concurrent append: every thread commits its own block over and over. Afterwards the
+ * log must hold exactly one transaction per commit, in sequence, and install must
+ * leave each block with the last image its thread committed. */
+#define TEST_THREADS 4
+#define TEST_TXNS    300
+
+struct commit_arg {
+    struct journal *j;
+    uint32_t blkno;
+    int rc;
+};
+
+static void *commit_thread(void *p) {
+    struct commit_arg *a = p;
+    uint8_t *img = xmalloc_block();
+    for (unsigned i = 0; i < TEST_TXNS && a->rc == 0; i++) {
+        struct journal_txn *t;
+        for (uint32_t k = 0; k < geo.block_size; k++)      /* no runs: full DATA images */
+            img[k] = (uint8_t)((k + i * 7) * 2654435761u >> 24);
+        memcpy(img, &a->blkno, sizeof(a->blkno));
+        memcpy(img + geo.block_size - sizeof(i), &i, sizeof(i));
+        if ((a->rc = journal_txn_begin(a->j, &t)) < 0) break;
+        if ((a->rc = journal_txn_log_block(t, a->blkno, img)) < 0) journal_txn_abort(t);
+        else a->rc = journal_txn_commit(t);
+    }
+    free(img);
+    return NULL;
+}
+
+static void test_commit_threads(int mmap_image, int background) {
+    struct journal_options opt = { 100, JOURNAL_SYNC_NONE, 0, 0, 1, 0, 0, mmap_image, 0, 0 };
+    if (background) {                          /* wake the checkpointer at 75%, down to 25% */
+        opt.checkpoint_pct = 75;
+        opt.background_checkpoint = 1;
+        opt.checkpoint_low_pct = 25;
+    }
+    struct journal *j;
+    die_rc("threads", journal_open("vsfs.img", &opt, &j));
+    struct journal_header before;
+    die_rc("threads", journal_read_header(j->fd, &before));
+
+    pthread_t tid[TEST_THREADS];
+    struct commit_arg arg[TEST_THREADS];
+    for (int i = 0; i < TEST_THREADS; i++) {
+        arg[i] = (struct commit_arg){ j, geo.total_blocks - 1 - (uint32_t)i, 0 };
+        if (pthread_create(&tid[i], NULL, commit_thread, &arg[i]) != 0) die_rc("pthread_create", -EAGAIN);
+    }
+    for (int i = 0; i < TEST_THREADS; i++) {
+        pthread_join(tid[i], NULL);
+        CHECK(arg[i].rc == 0);
+    }
+    struct journal_header after;
+    die_rc("threads", journal_read_header(j->fd, &after));
+    CHECK(after.next_seq - before.next_seq == TEST_THREADS * TEST_TXNS);
+    struct journal_stats st;
+    journal_get_stats(j, &st);
+    CHECK(st.checkpoints + st.bg_checkpoints > 0);  /* the log wrapped while claims were in flight */
+    if (background) CHECK(st.bg_checkpoints > 0);
+
+    /* what is still in the log scans as committed transactions up to the tail */
+    struct replay_index ix = {0};
+    struct scan_end end;
+    int ntxn = journal_scan(j->fd, &after, &ix, 0, &end);
+    free(ix.ents);
+    CHECK(ntxn == (int)(after.next_seq - after.head_seq));
+    CHECK(end.off == after.tail && end.bytes == after.nbytes_used - journal_log_start(&after));
+
+    die_rc("threads", journal_install(j, NULL));
+    uint8_t *img = xmalloc_block();
+    for (int i = 0; i < TEST_THREADS; i++) {
+        unsigned last;
+        uint32_t blkno;
+        die_rc("threads", read_block(j->fd, arg[i].blkno, img));
+        memcpy(&blkno, img, sizeof(blkno));
+        memcpy(&last, img + geo.block_size - sizeof(last), sizeof(last));
+        CHECK(blkno == arg[i].blkno && last == TEST_TXNS - 1);
+    }
+    free(img);
+    die_rc("threads", journal_close(j));
+}
+
+/* Metadata cache on an image of 32 KiB blocks, so that it holds few of them: lookups
+ * by block number, least recently used eviction, and dirty blocks never evicted */
+static void test_meta_cache(void) {
+    int fd = open_image();
+    struct meta_set *ms = meta_new(fd);
+    uint32_t first = geo.inode_bmap, cap = (uint32_t)ms->cap;
+    if (first + 2 * cap > geo.total_blocks) die_rc("cache: image too small", -EINVAL);
+
+    for (uint32_t b = first; b < first + cap; b++) CHECK(meta_get(ms, b) != NULL);
+    CHECK(ms->misses == cap && ms->hits == 0);
+    CHECK(meta_get(ms, first) != NULL && ms->hits == 1);      /* now the most recent */
+    meta_get(ms, first + 1)[0] ^= 1;
+    meta_mark_dirty(ms, first + 1);
+
+    /* cap - 2 more blocks push out everything else, oldest first */
+    for (uint32_t b = first + cap; b < first + 2 * cap - 2; b++) CHECK(meta_get(ms, b) != NULL);
+    CHECK(meta_lookup(ms, first) >= 0 && meta_lookup(ms, first + 1) >= 0);
+    for (uint32_t b = first + 2; b < first + cap; b++) CHECK(meta_lookup(ms, b) < 0);
+    CHECK(ms->ndirty == 1 && ms->e[ms->dirty_list[0]].blkno == first + 1);
+    unsigned misses = ms->misses;
+    CHECK(meta_get(ms, first + 2 * cap - 3) != NULL && ms->misses == misses);
+    CHECK(meta_get(ms, first + 2) != NULL && ms->misses == misses + 1);
+    CHECK(meta_lookup(ms, first) < 0);                        /* the least recent one went */
+    meta_free(ms);
+    close(fd);
+}
+
+/* Parallel write-back: every logged data block, some of them logged twice, must end
+ * up with its last image whichever worker's range it falls in */
+static void test_install_workers(int uring) {
+    struct journal_options opt = { 100, JOURNAL_SYNC_COMMIT, 0, 0, 0, 4, uring, 0, 0, 0 };
+    struct journal *j;
+    die_rc("install", journal_open("vsfs.img", &opt, &j));
+    uint32_t first = geo.data_start + 1, n = geo.total_blocks - first;   /* not the root dir */
+    CHECK(n >= 4 * INSTALL_MIN_PER_THREAD);
+    uint8_t *img = xmalloc((size_t)n * geo.block_size);
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t b = 0; b < n; b++) {
+            uint8_t *p = img + (size_t)b * geo.block_size;
+            for (uint32_t k = 0; k < geo.block_size; k++)
+                p[k] = (uint8_t)((k + b * 31 + (uint32_t)pass) * 2654435761u >> 24);
+        }
+        /* pass 1 logs every third block again */
+        for (uint32_t b = 0; b < n;) {
+            struct journal_txn *t;
+            die_rc("install", journal_txn_begin(j, &t));
+            for (int k = 0; k < 8 && b < n; b++)
+                if (pass == 0 || b % 3 == 0) {
+                    die_rc("install", journal_txn_log_block(t, first + b, img + (size_t)b * geo.block_size));
+                    k++;
+                }
+            die_rc("install", journal_txn_commit(t));
+        }
+    }
+    struct journal_install_stats st;
+    CHECK(journal_install(j, &st) == 1);
+    CHECK(st.nwrites == n);
+
+    uint8_t *home = xmalloc_block();
+    for (uint32_t b = 0; b < n; b++) {
+        die_rc("install", read_block(j->fd, first + b, home));
+        for (uint32_t k = 0; k < geo.block_size; k++)
+            if (home[k] != (uint8_t)((k + b * 31 + (b % 3 == 0)) * 2654435761u >> 24)) {
+                CHECK(!"home block holds the wrong image");
+                b = n;
+                break;
+            }
+    }
+    free(home);
+    free(img);
+    die_rc("install", journal_close(j));
+}
+
+/* O_DIRECT journal writes (block format): images the caller did not align go through
+ * a bounce buffer and still reach home intact */
+static void test_direct(void) {
+    struct journal_options opt = { 100, JOURNAL_SYNC_COMMIT, 1, 0, 0, 0, 0, 0, 0, 0 };
+    struct journal *j;
+    int rc = journal_open("vsfs.img", &opt, &j);
+    if (rc == -EINVAL) {                     /* no O_DIRECT on this filesystem */
+        printf("direct: skipped (%s)\n", journal_errmsg());
+        return;
+    }
+    die_rc("direct", rc);
+    uint32_t blk = geo.total_blocks - 1;
+    uint8_t *buf = xmalloc(geo.block_size + 1), *img = buf + 1;
+    for (uint32_t k = 0; k < geo.block_size; k++) img[k] = (uint8_t)(k * 7 + 1);
+    struct journal_txn *t;
+    die_rc("direct", journal_txn_begin(j, &t));
+    die_rc("direct", journal_txn_log_block(t, blk, img));
+    die_rc("direct", journal_txn_commit(t));
+    CHECK(journal_install(j, NULL) == 1);
+    uint8_t *home = xmalloc_block();
+    die_rc("direct", read_block(j->fd, blk, home));
+    CHECK(memcmp(home, img, geo.block_size) == 0);
+    free(home);
+    free(buf);
+    die_rc("direct", journal_close(j));
+}
+
+/* Free-space summaries on an image whose bitmaps span several blocks: with a scattered
+ * part of each bitmap already set, every search returns the lowest clear bit, until
+ * there is none */
+static void test_bitmap_sum(void) {
+    int fd = open_image();
+    struct meta_set *ms = meta_new(fd);
+    struct bitmap_sum *sums[2] = { &ms->isum, &ms->dsum };
+    uint32_t bits_per_blk = geo.block_size * 8;
+    for (int k = 0; k < 2; k++) {
+        struct bitmap_sum *sum = sums[k];
+        if (sum->nbits <= bits_per_blk) die_rc("bitmaps: image too small", -EINVAL);
+        for (uint32_t i = 0; i < sum->nbits / 2; i += i % 200 < 100 ? 3 : 1) {
+            bitmap_set(meta_get(ms, sum->first_blk + i / bits_per_blk), i % bits_per_blk);
+            meta_mark_dirty(ms, sum->first_blk + i / bits_per_blk);
+        }
+        uint32_t want = 0, bit;
+        int rc;
+        while ((rc = bitmap_find_zero(ms, sum, &bit)) == 0) {
+            while (bitmap_test(meta_get(ms, sum->first_blk + want / bits_per_blk), want % bits_per_blk)) want++;
+            CHECK(bit == want);
+            if (bit != want) break;
+            bitmap_alloc(ms, sum, bit);
+            bitmap_sum_take(ms, sum, bit);
+        }
+        CHECK(rc == -ENOSPC && want == sum->nbits - 1);
+        for (uint32_t b = 0; b < sum->nblks; b++) CHECK(sum->nfree[b] == 0);
+    }
+    meta_free(ms);
+    close(fd);
+}
+
+int main(int argc, char **argv) {
+    if (argc == 2 && strcmp(argv[1], "unit") == 0) {
+        test_crc32c();
+        test_crc32c_kernels();
+        test_bitmap_ffz();
+        test_rle();
+        test_full_io();
+        test_mkfs_state();
+        if (failures) {
+            fprintf(stderr, "%d check(s) failed\n", failures);
+            return 1;
+        }
+        printf("unit: ok\n");
+    } else if (argc == 2 && strcmp(argv[1], "ls") == 0) {
+        list_root();
+    } else if (argc == 2 && strcmp(argv[1], "tear") == 0) {
+        tear_tail();
+    } else if (argc == 2 && strcmp(argv[1], "replay") == 0) {
+        test_replay_order();
+        if (failures) return 1;
+    } else if ((argc == 2 || (argc == 3 && (strcmp(argv[2], "mmap") == 0 ||
+                                            strcmp(argv[2], "background") == 0))) &&
+               strcmp(argv[1], "threads") == 0) {
+        test_commit_threads(argc == 3 && argv[2][0] == 'm', argc == 3 && argv[2][0] == 'b');
+        if (failures) return 1;
+    } else if ((argc == 2 || (argc == 3 && strcmp(argv[2], "uring") == 0)) &&
+               strcmp(argv[1], "install") == 0) {
+        test_install_workers(argc == 3);
+        if (failures) return 1;
+    } else if (argc == 2 && strcmp(argv[1], "direct") == 0) {
+        test_direct();
+        if (failures) return 1;
+    } else if (argc == 2 && strcmp(argv[1], "cache") == 0) {
+        test_meta_cache();
+        if (failures) return 1;
+    } else if (argc == 2 && strcmp(argv[1], "bitmaps") == 0) {
+        test_bitmap_sum();
+        if (failures) return 1;
+    } else {
+        fprintf(stderr, "Usage: %s unit | ls | tear | replay | threads [mmap|background] | install [uring] | direct | cache | bitmaps\n",
+                argv[0]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,226 @@
+#!/bin/sh
+# Build the tool and tests/journal_test, then run the unit tests and the image tests
+# in a scratch directory. Usage: tests/run.sh (CC and CFLAGS are honoured)
+set -e
+src=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2 -Wall -Wextra}
+$CC $CFLAGS -pthread -o "$work/journal" "$src/journalv1.c" "$src/libjournal.c"
+$CC $CFLAGS -pthread -o "$work/journal_test" "$src/tests/journal_test.c"
+cd "$work"
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+# the installed root directory must hold exactly these names
+expect_names() {
+    want=$(printf '%s\n' "$@" | sort)
+    have=$(./journal_test ls | cut -d' ' -f1 | sort)
+    [ "$have" = "$want" ] || fail "$test: root holds '$(echo $have)', want '$(echo $want)'"
+}
+
+./journal_test unit
+
+for fmt in record block; do
+    test="create/install ($fmt)"
+    ./journal mkfs -F "$fmt" >/dev/null
+    ./journal create a >/dev/null
+    ./journal install >/dev/null
+    seq 1 20 | sed 's/^/f/' | ./journal create-batch - >/dev/null
+    ./journal install >/dev/null
+    expect_names a $(seq 1 20 | sed 's/^/f/')
+    echo "ok: $test"
+
+    # a torn last transaction is cut off when the journal is next appended to, so a
+    # transaction written after it is replayed
+    test="torn tail ($fmt)"
+    ./journal mkfs -F "$fmt" >/dev/null
+    ./journal create a >/dev/null
+    ./journal install >/dev/null
+    ./journal create b >/dev/null
+    ./journal_test tear
+    ./journal create c >/dev/null
+    ./journal install >/dev/null
+    expect_names a c
+    echo "ok: $test"
+
+    # separate runs see each other's uninstalled creates through the journal overlay
+    test="deferred install ($fmt)"
+    ./journal mkfs -F "$fmt" >/dev/null
+    ./journal create a >/dev/null
+    ./journal create b >/dev/null
+    seq 1 20 | sed 's/^/d/' | ./journal create-batch - >/dev/null
+    ./journal create a 2>/dev/null && fail "$test: duplicate accepted"
+    ./journal install >/dev/null
+    expect_names a b $(seq 1 20 | sed 's/^/d/')
+    echo "ok: $test"
+
+    # processes creating at once on shared handles, through a journal small enough
+    # that their groups close early and checkpoint
+    test="concurrent processes ($fmt)"
+    ./journal mkfs -F "$fmt" -i 256 -n 400 -j 16 >/dev/null
+    pids=
+    for p in a b c d; do
+        (
+            for i in $(seq 1 10); do ./journal create "$p$i" >/dev/null || exit 1; done
+            seq 1 20 | sed "s/^/$p-/" | ./journal -P -c 30 create-batch - >/dev/null
+        ) &
+        pids="$pids $!"
+    done
+    for pid in $pids; do wait "$pid" || fail "$test: a create failed"; done
+    ./journal install >/dev/null
+    expect_names $(for p in a b c d; do seq 1 10 | sed "s/^/$p/"; seq 1 20 | sed "s/^/$p-/"; done)
+    echo "ok: $test"
+
+    # concurrent append on an exclusive handle, through a small journal so that
+    # claims also wrap and wait for checkpoints
+    test="concurrent commits ($fmt)"
+    ./journal mkfs -F "$fmt" -j 32 >/dev/null
+    ./journal_test threads || fail "$test"
+    echo "ok: $test"
+
+    # a checkpointer thread frees the oldest transactions past 75% while commits go on;
+    # creates through a journal they keep filling still all get home (whether the
+    # thread or an appender got there first is timing, so only the threads test counts)
+    test="background checkpoint ($fmt)"
+    ./journal mkfs -F "$fmt" -j 128 >/dev/null       # 75% must clear one full group
+    ./journal_test threads background || fail "$test"
+    ./journal mkfs -F "$fmt" -i 256 -n 400 -j 8 >/dev/null
+    seq 1 200 | sed 's/^/b/' | ./journal -s full -P -c 60 -B 20 create-batch - >/dev/null || fail "$test"
+    ./journal install >/dev/null
+    expect_names $(seq 1 200 | sed 's/^/b/')
+    echo "ok: $test"
+
+    # install writes every data block back from 4 workers, in one checkpoint
+    test="parallel install ($fmt)"
+    ./journal mkfs -F "$fmt" -j 512 -n 800 >/dev/null
+    ./journal_test install || fail "$test"
+    echo "ok: $test"
+
+    # the same through io_uring (pread/pwrite where the kernel has none), and creates
+    # whose records and barrier go out in one submission
+    test="io_uring ($fmt)"
+    ./journal mkfs -F "$fmt" -j 512 -n 800 >/dev/null
+    ./journal_test install uring || fail "$test"
+    ./journal mkfs -F "$fmt" >/dev/null
+    seq 1 40 | sed 's/^/u/' | ./journal -U -s commit create-batch - >/dev/null
+    ./journal -U -s commit install >/dev/null
+    expect_names $(seq 1 40 | sed 's/^/u/')
+    echo "ok: $test"
+
+    # the image mapped: concurrent commits copy into the journal region, and creates
+    # through a small journal msync their ranges and checkpoint on the way
+    test="mmap ($fmt)"
+    ./journal mkfs -F "$fmt" -j 32 >/dev/null
+    ./journal_test threads mmap || fail "$test"
+    ./journal mkfs -F "$fmt" -j 8 >/dev/null
+    out=$(for i in 1 2 3 4; do
+        seq 1 10 | sed "s/^/m$i-/" | ./journal -M -s full -P create-batch -
+    done)
+    case $out in *" 1 checkpoint(s)"*) ;; *) fail "$test: $out" ;; esac
+    ./journal -M -s full install >/dev/null
+    expect_names $(for i in 1 2 3 4; do seq 1 10 | sed "s/^/m$i-/"; done)
+    echo "ok: $test"
+done
+
+test="delta replay order"
+./journal mkfs >/dev/null
+./journal_test replay || fail "$test"
+echo "ok: $test"
+
+test="direct writes"
+./journal mkfs -F block >/dev/null
+./journal_test direct || fail "$test"
+echo "ok: $test"
+
+test="metadata cache"
+./journal mkfs -b 32768 -n 400 >/dev/null
+./journal_test cache || fail "$test"
+echo "ok: $test"
+
+test="free-space summaries"
+./journal mkfs -b 1024 -i 20000 -n 30000 >/dev/null
+./journal_test bitmaps || fail "$test"
+echo "ok: $test"
+
+# -P logs plain DATA records
+test="plain records"
+./journal mkfs >/dev/null
+./journal -P create a >/dev/null
+./journal install >/dev/null
+./journal create b >/dev/null
+./journal install >/dev/null
+seq 1 20 | sed 's/^/p/' | ./journal -P create-batch - >/dev/null
+./journal install >/dev/null
+expect_names a b $(seq 1 20 | sed 's/^/p/')
+echo "ok: $test"
+
+# groups are sized as they are logged: 50 creates fit one transaction at 25%
+test="group sizing"
+./journal mkfs >/dev/null
+out=$(seq 1 50 | sed 's/^/g/' | ./journal -c 25 create-batch -)
+case $out in *"in 1 transaction(s)"*"0 checkpoint(s)"*) ;; *) fail "$test: $out" ;; esac
+./journal install >/dev/null
+expect_names $(seq 1 50 | sed 's/^/g/')
+echo "ok: $test"
+
+# the high-water mark never drops below one full group: -c 1 still groups
+test="small checkpoint-at"
+./journal mkfs -j 1024 >/dev/null
+out=$(seq 1 50 | sed 's/^/h/' | ./journal -c 1 create-batch -)
+case $out in *"in 1 transaction(s)"*"0 checkpoint(s)"*) ;; *) fail "$test: $out" ;; esac
+./journal install >/dev/null
+expect_names $(seq 1 50 | sed 's/^/h/')
+echo "ok: $test"
+
+# names are looked up through the root directory index: duplicates within a group,
+# in the journal and at home are all refused
+test="duplicate names"
+./journal mkfs -i 256 -n 400 >/dev/null
+out=$( (seq 1 150; seq 100 160) | sed 's/^/d/' | ./journal create-batch - 2>/dev/null)
+case $out in *"journaled 160 files"*"(51 failed)"*) ;; *) fail "$test: $out" ;; esac
+./journal create d7 2>/dev/null && fail "$test: d7 created twice"
+./journal install >/dev/null
+out=$(seq 155 170 | sed 's/^/d/' | ./journal create-batch - 2>/dev/null)
+case $out in *"journaled 10 files"*"(6 failed)"*) ;; *) fail "$test: $out" ;; esac
+./journal install >/dev/null
+expect_names $(seq 1 170 | sed 's/^/d/')
+echo "ok: $test"
+
+# names fill the 28-byte dirent field with its NUL: 27 bytes are the most, and a long
+# line is refused as a whole, not split into several names
+test="name length"
+n27=abcdefghijklmnopqrstuvwxyz0
+long=$(printf '%0300d' 0)
+./journal mkfs >/dev/null
+out=$(printf '%s\n' $n27 ${n27}1 $long | ./journal create-batch - 2>/dev/null)
+case $out in *"journaled 1 files"*"(2 failed)"*) ;; *) fail "$test: $out" ;; esac
+./journal create ${n27}2 2>/dev/null && fail "$test: a 28-byte name was created"
+./journal install >/dev/null
+expect_names $n27
+echo "ok: $test"
+
+# the daemon: clients pipeline requests over its socket and get every reply back
+test="serve"
+./journal mkfs -i 256 -n 400 >/dev/null
+./journal serve s.sock >serve.log 2>&1 &
+spid=$!
+i=0
+while [ ! -S s.sock ] && [ $i -lt 50 ]; do sleep 0.1; i=$((i + 1)); done
+pids=
+for p in a b; do
+    (seq 1 100 | sed "s/^/$p/" | ./journal -S s.sock create-batch - | grep -q "journaled 100 files") &
+    pids="$pids $!"
+done
+for pid in $pids; do wait "$pid" || fail "$test: a client got a wrong reply count"; done
+out=$(printf '%s\n' c1 $long c2 | ./journal -S s.sock create-batch - 2>/dev/null || true)
+case $out in *"journaled 2 files"*"(1 failed)"*) ;; *) fail "$test: $out" ;; esac
+kill -INT $spid
+wait $spid || fail "$test: $(cat serve.log)"
+./journal install >/dev/null
+expect_names $(seq 1 100 | sed 's/^/a/') $(seq 1 100 | sed 's/^/b/') c1 c2
+echo "ok: $test"